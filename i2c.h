@@ -1,13 +1,36 @@
+/** AVR I2C lib 
+ * This library provides an interrupt driven interface for AVR TWI hardware: master transactions (direct or queued) and auto slave mode.
+ * Each TWI unit is an I2C object, e.g. TWI0 and TWI1 of ATmega328PB can be used at the same time.
+ * The TWI ISR is emitted by I2C_ISR() in exactly one translation unit.
+ * To use the lib in more than one translation unit, define I2C_EXTERN before including this file in all but one of them; only declarations are included then.
+ */
 
+#ifndef I2C_H
+#define I2C_H
 
+#include <stddef.h>
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
+#include <util/atomic.h>
+#ifdef I2C_SMBUS
+#include "crc.h"
+#endif
+
+enum i2c_flag { //progmem: data to write is in flash; pec and block: SMBus, need I2C_SMBUS
+	i2c_flag_holdControl = 1, i2c_flag_retry = 2, i2c_flag_progmem = 4,
+	i2c_flag_pec = 8, i2c_flag_block = 16
+};
 
-enum i2c_flag { i2c_flag_holdControl = 1, i2c_flag_retry = 2 };
+enum i2c_dir { i2c_dir_write = 0, i2c_dir_read = 1, i2c_dir_writeRead = 2, i2c_dir_writeGather = 4 }; //Bit 0 is the R/W bit of the address byte
 
 enum i2c_state { //Next task
 	i2c_state_unknown = -1, i2c_state_free = 0,
 	i2c_state_masterWrite, i2c_state_masterRead,
+	i2c_state_queued, //Transaction waiting in the queue
+	i2c_state_slave, //Addressed by other master, auto slave mode
+	i2c_state_lost, //Arbitration lost, or START dropped because addressed as slave: bus busy with other master, the transaction restarts when the bus is free
 	i2c_state_error = -2
 };
 
@@ -17,28 +40,465 @@ enum i2c_status { //AVR TWSR code
 	i2c_status_masterWrite_dataAck = 0x28, i2c_status_masterWrite_dataNak = 0x30,
 	i2c_status_masterRead_addrAck = 0x40, i2c_status_masterRead_addrNak = 0x48,
 	i2c_status_masterRead_dataAck = 0x50, i2c_status_masterRead_dataNak = 0x58,
-	i2c_status_free = 0xF8, i2c_status_error = 0x00
+	i2c_status_slaveReceive_addrAck = 0x60, i2c_status_slaveReceive_lostAddrAck = 0x68,
+	i2c_status_slaveReceive_generalAck = 0x70, i2c_status_slaveReceive_lostGeneralAck = 0x78, //General call (address 0)
+	i2c_status_slaveReceive_dataAck = 0x80, i2c_status_slaveReceive_dataNak = 0x88,
+	i2c_status_slaveReceive_generalDataAck = 0x90, i2c_status_slaveReceive_generalDataNak = 0x98,
+	i2c_status_slave_stop = 0xA0, //STOP or repeated START while addressed as slave
+	i2c_status_slaveTransmit_addrAck = 0xA8, i2c_status_slaveTransmit_lostAddrAck = 0xB0,
+	i2c_status_slaveTransmit_dataAck = 0xB8, i2c_status_slaveTransmit_dataNak = 0xC0, i2c_status_slaveTransmit_lastAck = 0xC8,
+	i2c_status_free = 0xF8, i2c_status_error = 0x00,
+	i2c_status_pecError = 0x01, i2c_status_blockError = 0x02, //Not TWSR code, set by the SMBus layer (I2C_SMBUS)
+	i2c_status_absent = 0x03, //Not TWSR code, transaction refused by i2c_queue(): device absent in last scan
+	i2c_status_timeout = 0x04 //Not TWSR code, transaction aborted by i2c_tick(): I2C_TIMEOUT expired
 };
 
-volatile struct I2C{
+/** Bit rate solver. 
+ * SCL frequency = CPU frequency / (16 + 2 * TWBR * 4^TWPS). 
+ * I2C_BITRATE(f_cpu, f_i2c) chooses the smallest prescaler TWPS that fits TWBR in 8 bits, and rounds TWBR up so the bus never runs faster than f_i2c. 
+ * The result packs TWPS in bits 8-9 and TWBR in the low byte, bit 15 is always set so a valid setting is never 0; pass it to i2c_init() or put it in I2C_Transaction.bitrate. 
+ * Both arguments must be constants, e.g. I2C_BITRATE(F_CPU, I2C_FM); the whole calculation is done by the compiler. 
+ * An impossible config (f_i2c above I2C_RATE_MAX, CPU slower than 16 * f_i2c, or too slow even with TWPS = 64) fails to compile with "size of unnamed array is negative". 
+ * I2C_RATE(f_cpu, f_i2c) gives the achieved SCL frequency in Hz. 
+ */
+#define I2C_SM 100000UL //Standard mode
+#define I2C_FM 400000UL //Fast mode
+#define I2C_FMP 1000000UL //Fast mode plus, needs F_CPU >= 16MHz and Fm+ capable pads and slaves
+
+#ifndef I2C_RATE_MAX
+#define I2C_RATE_MAX I2C_FMP //Define as I2C_FM for MCU whose pads are not Fm+ rated
+#endif
+
+typedef uint16_t i2c_bitrate; //0x8000 | TWPS << 8 | TWBR, 0 for default
+
+#define I2C_DIVIDER(f_cpu, f_i2c) ((((f_cpu) + (f_i2c) - 1) / (f_i2c)) - 16) //2 * TWBR * 4^TWPS
+#define I2C_TWPS(f_cpu, f_i2c) ( I2C_DIVIDER(f_cpu, f_i2c) <= 2UL * 255 ? 0 : I2C_DIVIDER(f_cpu, f_i2c) <= 8UL * 255 ? 1 : I2C_DIVIDER(f_cpu, f_i2c) <= 32UL * 255 ? 2 : 3 )
+#define I2C_TWBR(f_cpu, f_i2c) ( ( I2C_DIVIDER(f_cpu, f_i2c) + (2UL << (2 * I2C_TWPS(f_cpu, f_i2c))) - 1 ) / (2UL << (2 * I2C_TWPS(f_cpu, f_i2c))) )
+#define I2C_RATE(f_cpu, f_i2c) ( (f_cpu) / (16 + I2C_TWBR(f_cpu, f_i2c) * (2UL << (2 * I2C_TWPS(f_cpu, f_i2c)))) )
+#define I2C_VALID(f_cpu, f_i2c) ( (f_i2c) <= I2C_RATE_MAX && (f_cpu) >= 16 * (f_i2c) && I2C_DIVIDER(f_cpu, f_i2c) <= 128UL * 255 )
+#define I2C_BITRATE(f_cpu, f_i2c) ( (i2c_bitrate)( (0x8000 | I2C_TWPS(f_cpu, f_i2c) << 8 | I2C_TWBR(f_cpu, f_i2c)) + 0 * sizeof(char[I2C_VALID(f_cpu, f_i2c) ? 1 : -1]) ) )
+
+/** Running CRC. 
+ * Define I2C_CRC as the name of a CRC update function before including this lib, e.g. "#define I2C_CRC crc_smbus8" after including crc.h. 
+ * Each data byte written by i2c_master_write() or read by i2c_master_read() is folded into the running CRC in the ISR. Address bytes are not folded. 
+ * The CRC type follows the return type of the function. 
+ */
+#ifdef I2C_CRC
+typedef __typeof__(I2C_CRC(0, 0)) i2c_crc;
+#endif
+
+/** SMBus support. 
+ * Define I2C_SMBUS before including this lib to enable it (needs crc.h), then per transaction: 
+ * - i2c_flag_pec: Packet Error Code. CRC-8/SMBus of every byte on the wire, address bytes included, is computed in the ISR as the bytes go. 
+ *   A write ends with the PEC byte appended by the ISR; a read (or the read phase of write-then-read) receives one more byte after the data and compares it with the PEC, 
+ *   mismatch ends the transaction with error and status i2c_status_pecError (retried if i2c_flag_retry). The PEC byte is not stored and not counted in size. 
+ * - i2c_flag_block: Block read. The first byte read is the byte count N, the ISR reads N more bytes then ends; 
+ *   the buffer gets the count then the data, its size (at least 2) is the max. If N is 0 or does not fit, the next byte is NAKed and the transaction ends with i2c_status_blockError. 
+ *   Block write needs no flag, put the count before the data (e.g. segments {command, count} and {data} of i2c_master_writeGather()). 
+ * Not supported with ring read (I2C_Ring). 
+ * Clock low timeout: SMBus requires the master to give up if the bus is stuck for 25ms to 35ms. With I2C_SMBUS, the timeout (I2C_TIMEOUT) is reloaded by every TWI interrupt, 
+ * so it measures the time since the last bus event instead of the whole transaction. Define I2C_SMBUS_TICK as the frequency of i2c_tick() in Hz (200Hz or faster, default 1kHz), 
+ * and I2C_TIMEOUT defaults to the number of ticks that expires between 25ms and 35ms (26 at 1kHz). 
+ * e.g. Read word with PEC: i2c_master_writeRead(&i2c0, 0x0B, i2c_flag_pec, cmd, 1, word, 2); Block read: i2c_master_writeRead(&i2c0, 0x0B, i2c_flag_pec | i2c_flag_block, cmd, 1, buffer, 33). 
+ */
+#ifdef I2C_SMBUS
+#ifndef I2C_SMBUS_TICK
+#define I2C_SMBUS_TICK 1000
+#endif
+#ifndef I2C_TIMEOUT
+#define I2C_TIMEOUT ((25UL * I2C_SMBUS_TICK + 999) / 1000 + 1) //At least 25ms after the last event, the first tick may come right after it
+#endif
+#if I2C_TIMEOUT * 1000 < 25UL * I2C_SMBUS_TICK + 1000 || I2C_TIMEOUT * 1000 > 35UL * I2C_SMBUS_TICK
+#error "I2C_SMBUS: I2C_TIMEOUT does not fit the 25-35ms clock low timeout, use a faster tick (I2C_SMBUS_TICK at least 200Hz)"
+#endif
+#endif
+
+/** Slave address of master transactions. 
+ * A 7-bit address (0-127) is used as is; I2C_ADDR10(addr) gives a 10-bit address (0-1023). 
+ * A 10-bit address is sent as two bytes: 11110 A9 A8 W, then A7-A0 as the first byte after the address ACK. 
+ * To read, the ISR sends the two bytes with W first, then repeated START and only 11110 A9 A8 R (repeated START read rule), 
+ * so a read from a 10-bit slave costs one more byte and a repeated START; write-then-read only sends 11110 A9 A8 R after the repeated START. 
+ */
+typedef uint16_t i2c_addr;
+#define I2C_ADDR10(addr) ((i2c_addr)(0x8000 | (addr)))
+
+/** Size of the transaction queue, must be power of 2. 
+ * The queue can hold I2C_QUEUE_SIZE-1 transactions waiting, plus the active one. 
+ */
+#ifndef I2C_QUEUE_SIZE
+#define I2C_QUEUE_SIZE 8
+#endif
+
+/** Max number of probes again of the same address by i2c_scan(), on errors other than address NAK (e.g. bus error, timeout). 
+ * After that, the address is left present (unknown, i2c_queue() does not refuse it) and counted by i2c_getScanFail(), and the scan moves on. 
+ */
+#ifndef I2C_SCAN_RETRY
+#define I2C_SCAN_RETRY 3
+#endif
+
+/** Init script in flash (PROGMEM), executed by i2c_script(). 
+ * A sequence of records, each one is: slave address (0-127), length (0-255), length bytes of data, delay after the write in ms (0-255). 
+ * The script ends with I2C_SCRIPT_END in place of the address, e.g.: 
+ * const uint8_t oled[] PROGMEM = {0x3C, 2, 0x00, 0xAE, 0,  0x3C, 2, 0x00, 0xAF, 100,  I2C_SCRIPT_END}; 
+ */
+#define I2C_SCRIPT_END 0xFF
+
+/** Segment of a scatter-gather write. 
+ * The segments of a transaction are sent back-to-back in one transaction, e.g. register address in one segment and payload in another, without copying them into one buffer. 
+ * The segment array and the data must be stored in global space, the ISR reads them during the transaction. 
+ */
+typedef struct I2C_Segment {
+	volatile uint8_t * data; //Data to send, DO NOT remove the volatile qualifier
+	uint16_t size; //Size of the segment in bytes, may be 0
+} I2C_Segment;
+
+/** Ring buffer for streaming read (single producer: the ISR, single consumer: the application). 
+ * The ISR writes the bytes read into the ring with wraparound while the application drains it with i2c_ringPop(), even during the read, 
+ * hence a long read (e.g. sensor FIFO burst) needs neither its length in advance nor a buffer of its size. 
+ * If the ring is full, the ISR holds SCL low (clock stretching by the master) until the application pops a byte. 
+ * Once a byte is in the ring, the read is never restarted (no retry, no restart after arbitration lost): on failure it ends with error, the bytes in the ring are valid, count of the transaction tells how many. 
+ * Init it with i2c_ringInit(), must be stored in global space. 
+ */
+typedef volatile struct I2C_Ring {
+	volatile uint8_t * volatile buffer;
+	volatile uint8_t mask; //Size - 1, size is a power of 2 (2-128)
+	volatile uint8_t in, out; //Free running indexes, in is written by the ISR only, out by the application only
+} I2C_Ring;
+
+/** I2C transaction descriptor, used by the transaction queue. 
+ * Fill addr, dir, flag, data and size, then submit it with i2c_queue(). The ISR fills state, status, count and retry. 
+ * The descriptor is the handle of the transaction: many transactions can be in flight, each one keeps its own result when it ends, check them later in any order. 
+ * Success is state i2c_state_free; count tells how far a failed transaction went. 
+ * For i2c_dir_writeGather, fill segment and set size to the number of segments (at least 1) instead of data. 
+ * The done callback runs in the ISR, it may submit the next transaction with i2c_queue(), e.g. to chain a protocol without the main program. 
+ * Must be stored in global sapce (define it outside of any function), the ISR accesses it until its state becomes i2c_state_free or i2c_state_error. 
+ * Devices of different speed can share the bus: set bitrate to the speed of the device, the TWBR and TWPS are switched right before its START. 
+ * Note that the STOP of the previous transaction is then generated at the new speed. 
+ */
+typedef volatile struct I2C_Transaction {
+	i2c_addr addr; //Slave address (0-127), or I2C_ADDR10()
+	enum i2c_dir dir; //Write to, read from, or write to then read from (repeated START) the slave
+	enum i2c_flag flag; //ORed enum i2c_flag to set the behaviour of this transaction
+	volatile uint8_t * volatile data; //Data to send or space to save the data, DO NOT remove the volatile qualifier
+	uint16_t size; //Size of the string in bytes
+	volatile uint8_t * volatile readData; //i2c_dir_writeRead only: space to save the data read after repeated START
+	uint16_t readSize; //i2c_dir_writeRead only: size of the data to read in bytes
+	volatile enum i2c_state state; //Output: i2c_state_queued, i2c_state_masterWrite/Read when active, i2c_state_free when done, i2c_state_error if aborted
+	volatile uint8_t status; //Output: Last hardware status register (TWSR) of this transaction, or a library code (e.g. i2c_status_pecError)
+	volatile uint16_t count; //Output: Bytes transferred when the transaction ends, both phases, a written byte refused by NAK included; address bytes and PEC not counted
+	volatile uint8_t retry; //Output: Number of retries used (i2c_flag_retry)
+	i2c_bitrate bitrate; //Bus speed of this transaction from I2C_BITRATE(), 0 to use the bit rate set by i2c_init()
+	const I2C_Segment * segment; //i2c_dir_writeGather only: segment array, size is the number of segments
+	I2C_Ring * ring; //Read into this ring instead of data (i2c_dir_read) or readData (i2c_dir_writeRead), NULL if not used
+	void (* done)(volatile struct I2C_Transaction * t); //Called in the ISR when the transaction ends (state is i2c_state_free or i2c_state_error), NULL if not used
+} I2C_Transaction;
+
+/** Auto slave write-complete callback. 
+ * Called in the ISR when the master ends a write (STOP or repeated START) in which at least one register is written. 
+ * @param reg First register written
+ * @param count Number of bytes written, the register pointer wraps to 0 after the last register
+ */
+typedef void (* i2c_slaveCallback)(uint8_t reg, uint8_t count);
+
+/** Retry policy for transactions flaged i2c_flag_retry. 
+ * On address NAK (e.g. EEPROM busy in write cycle) and bus error, the ISR restarts the transaction from its first byte, at most I2C_RETRY_MAX times. 
+ * Arbitration lost is not an error and is not counted, see i2c_state_lost. 
+ * A streaming read (ring) is never restarted once a byte is in the ring, the consumer may have popped it already: it ends with error instead, on any failure or arbitration lost. 
+ * If I2C_RETRY_BACKOFF is 0, the transaction restarts immediately in the ISR (STOP then START). 
+ * Otherwise, the bus is released and the transaction restarts after I2C_RETRY_BACKOFF << (n-1) ticks for the n-th retry; 
+ * this needs i2c_tick() to be placed in a timer ISR. 
+ */
+#ifndef I2C_RETRY_MAX
+#define I2C_RETRY_MAX 3
+#endif
+#ifndef I2C_RETRY_BACKOFF
+#define I2C_RETRY_BACKOFF 0
+#endif
+
+/** Bus hang detection. 
+ * If I2C_TIMEOUT is not 0, a master transaction not finished I2C_TIMEOUT ticks after its START is aborted: 
+ * the TWI is disabled, the bus is cleared by i2c_busClear() (up to nine SCL pulses until the slave releases SDA, then STOP), 
+ * the TWI is re-initialised, and the transaction ends with i2c_state_error and status i2c_status_timeout. 
+ * This needs i2c_tick() to be placed in a timer ISR (e.g. timer compare match), the tick period is the unit of I2C_TIMEOUT. 
+ * Choose I2C_TIMEOUT longer than the longest transaction, including clock stretching. 
+ * A transaction waiting for the bus after arbitration lost (i2c_state_lost) is not timed out, the bus belongs to the other master; its count restarts with its START. 
+ * With I2C_SMBUS, the count restarts at each TWI interrupt instead, see I2C_SMBUS. 
+ */
+#ifndef I2C_TIMEOUT
+#define I2C_TIMEOUT 0
+#endif
+
+/** Default SDA and SCL pins of the first TWI unit, used by i2c_busClear() to bit-bang the bus. 
+ * Defaults are provided for ATmega328/P, ATmega168/88/48, ATmega8/16/32 and ATmega640/1280/2560. 
+ * For other MCU, define I2C_PIN (the PINx register, DDRx and PORTx follow it) and I2C_SDA, I2C_SCL (bit number) before including this lib. 
+ * Use i2c_busPins() for other TWI units. 
+ */
+#ifndef I2C_SCL
+	#if defined(__AVR_ATmega328P__) || defined(__AVR_ATmega328__) || defined(__AVR_ATmega168__) || defined(__AVR_ATmega168P__) || defined(__AVR_ATmega88__) || defined(__AVR_ATmega88P__) || defined(__AVR_ATmega48__) || defined(__AVR_ATmega48P__)
+		#define I2C_PIN PINC
+		#define I2C_SDA 4
+		#define I2C_SCL 5
+	#elif defined(__AVR_ATmega8__) || defined(__AVR_ATmega16__) || defined(__AVR_ATmega32__)
+		#define I2C_PIN PINC
+		#define I2C_SDA 1
+		#define I2C_SCL 0
+	#elif defined(__AVR_ATmega640__) || defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__)
+		#define I2C_PIN PIND
+		#define I2C_SDA 1
+		#define I2C_SCL 0
+	#endif
+#endif
+
+/** I2C class data, one object per TWI unit. 
+ * Do NOT directly modify/read! 
+ * Must be stored in global sapce (define it outside of any function, define at compile time, no dynamic allocation of this variable) 
+ */
+typedef volatile struct I2C {
+	volatile uint8_t * volatile sfrAddr; //TWBR of this TWI unit
 	volatile enum i2c_state state;
 	volatile uint8_t status; //Hardware status register (TWSR), record
 	volatile enum i2c_flag flag;
 
 	volatile uint8_t deviceAddr;
+	volatile uint8_t addr10, addrLow; //10-bit address: 1 if A7-A0 (addrLow) to send after address ACK, 2 if sent, 0 if 7-bit address
 	volatile uint8_t * volatile dataStart, * volatile dataPtr, * volatile dataEnd;
-} i2c = {
-	.state = i2c_state_unknown
-};
+	volatile uint8_t * volatile readStart, * volatile readEnd; //Read phase of write-then-read transaction, equal if none
+	volatile uint8_t firstAddr; //Address byte of the first phase, for retry
+	volatile uint8_t * volatile firstEnd; //End of the first phase, for retry (dataStart is the start)
+	const I2C_Segment * volatile segNext, * volatile segEnd; //Scatter-gather write: next segment to load and end of the segment array, equal if none
+	const I2C_Segment * volatile segFirst; //Second segment, for retry
+	I2C_Ring * volatile ring; //Streaming read into ring, NULL if none
+	volatile uint16_t ringLeft, ringSize; //Bytes left to read into the ring; total, for retry
+	volatile uint8_t ringStall; //Ring full, SCL held low with interrupt disabled until i2c_ringPop()
+	volatile uint8_t lost; //Arbitration lost or pending START dropped, then addressed as slave: restart the master transaction at the end of the slave transaction
+	volatile uint8_t retry; //Number of retries of current transaction
+	volatile uint16_t total; //Bytes of current transaction, both phases, for the count of the transaction
+	volatile uint16_t backoff; //Ticks to wait before retry, 0 if no retry pending
+	volatile uint16_t timeout; //Ticks left before the active transaction is considered hung
+	volatile i2c_bitrate bitrate; //Default bit rate, for transactions without their own bit rate and re-init after bus clear
+	volatile uint8_t * volatile busPin; //PINx of SDA and SCL for bus clear, NULL if unknown
+	volatile uint8_t busSda, busScl; //Bit mask of SDA and SCL in busPin
+#ifdef I2C_CRC
+	volatile i2c_crc crc, crcStart; //crcStart: CRC before current transaction, for retry
+#endif
+#ifdef I2C_SMBUS
+	volatile uint8_t pec; //Running PEC of current transaction
+	volatile uint8_t pecSent; //Write: PEC byte sent
+	volatile uint8_t blockCount; //Block read: next byte read is the byte count
+	volatile uint8_t blockError; //Block read: count is 0 or does not fit, NAK the next byte and fail
+	volatile uint16_t blockUnused; //Block read: buffer space after the data, not counted as transferred
+#endif
+
+	I2C_Transaction * volatile transaction; //Active queued transaction, NULL if started by i2c_master_write/read()
+	I2C_Transaction * volatile queue[I2C_QUEUE_SIZE];
+	volatile uint8_t queueIn, queueOut;
+
+	volatile uint8_t present[16]; //Device presence bitmap, bit (addr & 7) of byte (addr >> 3); set unless found absent by i2c_scan()
+	volatile uint8_t scanAddr; //Address being probed, 0 if no scan running
+	volatile uint8_t scanData; //Byte read by read probe, discarded
+	volatile uint8_t scanRetry; //Probes again of the current address
+	volatile uint8_t scanFail; //Addresses the last scan could not probe
+	I2C_Transaction scan; //Probe transaction
+
+	volatile uint8_t slaveCtrl; //TWCR bits to keep the slave listening, (1 << TWEA) | (1 << TWIE) if auto slave mode enabled
+	volatile uint8_t * volatile slaveRegs; //Register file
+	const uint8_t * volatile slaveMask; //Write mask in flash, NULL if all bits writable
+	volatile uint8_t slaveSize, slavePtr, slavePtrNext; //slavePtrNext: next byte received is the register pointer
+	volatile uint8_t slaveWriteReg, slaveWriteCount;
+	volatile i2c_slaveCallback slaveCallback;
+} I2C;
+
+/** Emit the TWI ISR of an I2C object. 
+ * Use it once for each TWI unit, in the translation unit that includes this lib without I2C_EXTERN, e.g. I2C_ISR(TWI_vect, i2c0, &TWBR). 
+ * The object and the register base are constants in the ISR, so the compiler accesses both with direct addressing, 
+ * hence a second TWI unit costs no extra cycle per byte. 
+ * @param vector TWI interrupt vector, e.g. TWI_vect, TWI0_vect or TWI1_vect
+ * @param object The I2C object (not a pointer)
+ * @param sfr_base Address of TWBR of the TWI unit, e.g. &TWBR, &TWBR0 or &TWBR1
+ */
+#define I2C_ISR(vector, object, sfr_base) ISR(vector) { i2c_isr(&(object), (volatile uint8_t *)(sfr_base)); }
+
+/* == Declaration =========================================================================== */
+
+void i2c_init(I2C * const i2c, volatile void * const sfr_base, const i2c_bitrate bitrate);
+void i2c_busPins(I2C * const i2c, volatile uint8_t * const pin, const uint8_t sda, const uint8_t scl);
+void i2c_busClear(I2C * const i2c);
+void i2c_master_write(I2C * const i2c, i2c_addr addr, enum i2c_flag flag, volatile uint8_t * volatile data, uint16_t size);
+void i2c_master_writeProgmem(I2C * const i2c, i2c_addr addr, enum i2c_flag flag, const uint8_t * data, uint16_t size);
+void i2c_master_read(I2C * const i2c, i2c_addr addr, enum i2c_flag flag, volatile uint8_t * volatile data, uint16_t size);
+void i2c_master_writeRead(I2C * const i2c, i2c_addr addr, enum i2c_flag flag, volatile uint8_t * volatile wdata, uint16_t wsize, volatile uint8_t * volatile rdata, uint16_t rsize);
+void i2c_master_writeGather(I2C * const i2c, i2c_addr addr, enum i2c_flag flag, const I2C_Segment * segment, uint16_t count);
+void i2c_master_readRing(I2C * const i2c, i2c_addr addr, enum i2c_flag flag, I2C_Ring * ring, uint16_t size);
+void i2c_ringInit(I2C_Ring * const ring, volatile uint8_t * buffer, uint8_t size);
+uint8_t i2c_ringCount(const I2C_Ring * const ring);
+uint8_t i2c_ringPop(I2C * const i2c, I2C_Ring * const ring, uint8_t * const data);
+uint8_t i2c_queue(I2C * const i2c, I2C_Transaction * const t);
+uint8_t i2c_scan(I2C * const i2c);
+uint8_t i2c_isScanning(const I2C * const i2c);
+uint8_t i2c_getScanFail(const I2C * const i2c);
+uint8_t i2c_getPresent(const I2C * const i2c, i2c_addr addr);
+const volatile uint8_t * i2c_getPresentMap(const I2C * const i2c);
+void i2c_tick(I2C * const i2c);
+void i2c_slave_init(I2C * const i2c, uint8_t addr, volatile uint8_t * regs, const uint8_t * mask, uint8_t size, i2c_slaveCallback callback);
+void i2c_slave_disable(I2C * const i2c);
+void i2c_slave_generalCall(I2C * const i2c, uint8_t enable);
+enum i2c_status i2c_getStatus(const I2C * const i2c);
+enum i2c_state i2c_getState(const I2C * const i2c);
+uint16_t i2c_getProgress(const I2C * const i2c);
+uint8_t i2c_waitIdle(const I2C * const i2c, volatile const uint16_t * const timeout);
+uint8_t i2c_script(I2C * const i2c, const uint8_t * script);
+#ifdef I2C_CRC
+i2c_crc i2c_getCrc(const I2C * const i2c);
+void i2c_crcReset(I2C * const i2c, i2c_crc init);
+#endif
 
-/** Init I2C. 
- * Set the bitrate of the I2C bus. 
- * @param f_cpu CPU frequency
- * @param f_i2c I2C bitrate
+/* == Definition ============================================================================ */
+
+#ifndef I2C_EXTERN
+
+#include <util/delay.h>
+
+#define SFR_TWBR 0
+#define SFR_TWSR 1
+#define SFR_TWAR 2
+#define SFR_TWDR 3
+#define SFR_TWCR 4
+#define SFR_TWAMR 5
+
+/* Write TWBR and the TWPS bits of TWSR, the status bits of TWSR are read-only. */
+static inline void i2c_writeBitrate(volatile uint8_t * const sfr, const i2c_bitrate bitrate) {
+	sfr[SFR_TWBR] = bitrate & 0xFF;
+	sfr[SFR_TWSR] = (bitrate >> 8) & 0x03;
+}
+
+/** Init or reset an I2C object, set the bitrate of the I2C bus. 
+ * Some MCU comes with multiple TWI units (e.g. ATmega328PB), each one needs its own object and I2C_ISR(). 
+ * @param i2c An I2C object, pass-by-reference, must be defined in global space at compile time
+ * @param sfr_base Address of TWBR of the desired TWI unit
+ * @param bitrate Bit rate settings from I2C_BITRATE(), e.g. i2c_init(&i2c0, &TWBR, I2C_BITRATE(F_CPU, I2C_SM))
+ */
+void i2c_init(I2C * const i2c, volatile void * const sfr_base, const i2c_bitrate bitrate) {
+	i2c->sfrAddr = sfr_base;
+	i2c->state = i2c_state_free;
+	i2c->bitrate = bitrate;
+	for (uint8_t i = 0; i < sizeof(i2c->present); i++)
+		i2c->present[i] = 0xFF; //Not scanned, all addresses allowed
+#ifdef I2C_PIN
+	i2c->busPin = &I2C_PIN; //Default pins, for the first TWI unit
+	i2c->busSda = 1 << I2C_SDA;
+	i2c->busScl = 1 << I2C_SCL;
+#endif
+	i2c_writeBitrate(i2c->sfrAddr, bitrate);
+}
+
+/** Set the SDA and SCL pins used by i2c_busClear(). 
+ * Needed for TWI units other than the first one, or if no default pins are provided for the MCU. 
+ * @param i2c An I2C object
+ * @param pin Address of the PINx register of the port, DDRx and PORTx must follow it
+ * @param sda Bit number of SDA in the port
+ * @param scl Bit number of SCL in the port
  */
-void i2c_init(uint32_t f_cpu, uint32_t f_i2c) {
-	i2c.state = i2c_state_free;
-	TWBR = ( f_cpu / f_i2c - 16 ) / 2; //SCL frequency = CPU frequency / (16 + 2 * TWBR)
+void i2c_busPins(I2C * const i2c, volatile uint8_t * const pin, const uint8_t sda, const uint8_t scl) {
+	i2c->busPin = pin;
+	i2c->busSda = 1 << sda;
+	i2c->busScl = 1 << scl;
+}
+
+/** Free a bus held by a slave, e.g. a slave holding SDA low after the MCU reset in the middle of a read. 
+ * The TWI is disabled, SCL is pulsed up to nine times until the slave releases SDA, then a STOP is sent; 
+ * after that, the bit rate is re-initialised and the TWI is enabled again. 
+ * If the pins are unknown (see i2c_busPins()), only the TWI is reset. 
+ * Called by i2c_tick() on transaction timeout; the application may also call it once after i2c_init() at power-up. 
+ * Takes about 100us (5us half period), F_CPU must be defined. 
+ * Do not call while a transaction is active. 
+ * @param i2c I2C object initialised by i2c_init()
+ */
+void i2c_busClear(I2C * const i2c) {
+	volatile uint8_t * const sfr = i2c->sfrAddr;
+	volatile uint8_t * const pin = i2c->busPin;
+	sfr[SFR_TWCR] = 0; //Disable TWI, pins become GPIO
+	if (pin) {
+		volatile uint8_t * const ddr = pin + 1, * const port = pin + 2;
+		const uint8_t sda = i2c->busSda, scl = i2c->busScl;
+		uint8_t pullup = *port & (sda | scl);
+		*port &= ~(sda | scl); //Open drain: DDR set drives low, DDR clear releases the line to the pull-up
+		*ddr &= ~(sda | scl);
+		for (uint8_t i = 9; i && !(*pin & sda); i--) {
+			*ddr |= scl;
+			_delay_us(5);
+			*ddr &= ~scl;
+			_delay_us(5);
+		}
+		*ddr |= scl; //STOP: SDA low to high while SCL high
+		_delay_us(5);
+		*ddr |= sda;
+		_delay_us(5);
+		*ddr &= ~scl;
+		_delay_us(5);
+		*ddr &= ~sda;
+		_delay_us(5);
+		*port |= pullup;
+	}
+	i2c_writeBitrate(sfr, i2c->bitrate);
+	sfr[SFR_TWCR] = (1 << TWEN) | i2c->slaveCtrl;
+}
+
+#ifdef I2C_SMBUS
+/* Reset the SMBus state at the first START of a transaction, and on retry. */
+static inline void i2c_smbusReset(I2C * const i2c) {
+	i2c->pec = crc_smbus8_init;
+	i2c->pecSent = 0;
+	i2c->blockCount = i2c->flag & i2c_flag_block;
+	i2c->blockError = 0;
+	i2c->blockUnused = 0;
+}
+#endif
+
+/* Load a transaction into the ISR working registers, does not touch the hardware. 
+ * sla is the address byte of the first phase; rdata/rsize is the read phase after repeated START, rsize 0 if none. */
+static inline void i2c_begin(I2C * const i2c, const uint8_t sla, const enum i2c_flag flag, volatile uint8_t * const data, const uint16_t size, volatile uint8_t * const rdata, const uint16_t rsize) {
+	i2c->state = (sla & 1) ? i2c_state_masterRead : i2c_state_masterWrite;
+	i2c->flag = flag;
+	i2c->deviceAddr = sla;
+	i2c->firstAddr = sla;
+	i2c->dataStart = data;
+	i2c->dataPtr = data;
+	i2c->dataEnd = data + size;
+	i2c->firstEnd = data + size;
+	i2c->readStart = rdata;
+	i2c->readEnd = rdata + rsize;
+	i2c->total = size + rsize;
+	i2c->addr10 = 0;
+	i2c->segNext = NULL;
+	i2c->segEnd = NULL;
+	i2c->ring = NULL;
+	i2c->ringLeft = 0;
+	i2c->ringStall = 0;
+	i2c->lost = 0;
+	i2c->retry = 0;
+	i2c->backoff = 0;
+	i2c->timeout = I2C_TIMEOUT;
+#ifdef I2C_CRC
+	i2c->crcStart = i2c->crc;
+#endif
+#ifdef I2C_SMBUS
+	i2c_smbusReset(i2c);
+#endif
+}
+
+/* Load a transaction to a 7-bit or 10-bit address (i2c_addr), read is non-zero for a read-only transaction. 
+ * A 10-bit read is loaded as write-then-read with an empty write phase: the ISR sends A7-A0 in the write phase. */
+static inline void i2c_beginAddr(I2C * const i2c, const i2c_addr addr, const uint8_t read, const enum i2c_flag flag, volatile uint8_t * const data, const uint16_t size, volatile uint8_t * const rdata, const uint16_t rsize) {
+	if (addr & 0x8000) {
+		if (read)
+			i2c_begin(i2c, 0xF0 | ((addr >> 7) & 0x06), flag, NULL, 0, data, size);
+		else
+			i2c_begin(i2c, 0xF0 | ((addr >> 7) & 0x06), flag, data, size, rdata, rsize);
+		i2c->addr10 = 1;
+		i2c->addrLow = addr;
+	} else {
+		i2c_begin(i2c, (addr << 1) | (read ? 1 : 0), flag, data, size, rdata, rsize);
+	}
 }
 
 /** Use ISR to send a string of character on I2C. 
@@ -46,20 +506,31 @@ void i2c_init(uint32_t f_cpu, uint32_t f_i2c) {
  * The string must be saved in memory because it needs to be accessible in the ISR, hence be volatile. 
  * It is recommanded to use dedicated space to save the string, e.g., in global space. 
  * If the string is saved in stack, make sure it will not be overridden after current function returned prior the sring is fully sent. 
- * @param addr Slave addresss (0-127)
+ * @param i2c I2C object initialised by i2c_init()
+ * @param addr Slave addresss (0-127), or I2C_ADDR10() for 10-bit
  * @param flag ORed enum i2c_flag to set the behaviour of this transaction
  * @param data A pointer to the data to send, DO NOT remove the volatile qualifier
  * @param size Size of the string in bytes
  */
-void i2c_master_write(uint8_t addr, enum i2c_flag flag, volatile uint8_t * volatile data, uint16_t size) {
-	i2c.state = i2c_state_masterWrite;
-	i2c.flag = flag;
-	i2c.deviceAddr = (addr << 1);
-	i2c.dataStart = data;
-	i2c.dataPtr = data;
-	i2c.dataEnd = data + size;
-	TWCR = (1 << TWINT) | (1 << TWSTA) | (1 << TWEN) | (1 << TWIE);
+void i2c_master_write(I2C * const i2c, i2c_addr addr, enum i2c_flag flag, volatile uint8_t * volatile data, uint16_t size) {
+	i2c->transaction = NULL;
+	i2c_beginAddr(i2c, addr, 0, flag, data, size, NULL, 0);
+	i2c_writeBitrate(i2c->sfrAddr, i2c->bitrate);
+	i2c->sfrAddr[SFR_TWCR] = (1 << TWINT) | (1 << TWSTA) | (1 << TWEN) | (1 << TWIE);
+
+}
 
+/** Use ISR to send a string of character stored in flash (PROGMEM) on I2C, e.g. a constant configuration table. 
+ * Same as i2c_master_write() with i2c_flag_progmem, the ISR reads the data from flash, no SRAM is used for the data. 
+ * To queue a flash write, set i2c_flag_progmem in the transaction and cast the flash address to data. 
+ * @param i2c I2C object initialised by i2c_init()
+ * @param addr Slave addresss (0-127), or I2C_ADDR10() for 10-bit
+ * @param flag ORed enum i2c_flag to set the behaviour of this transaction
+ * @param data Address of the data in flash
+ * @param size Size of the string in bytes
+ */
+void i2c_master_writeProgmem(I2C * const i2c, i2c_addr addr, enum i2c_flag flag, const uint8_t * data, uint16_t size) {
+	i2c_master_write(i2c, addr, flag | i2c_flag_progmem, (volatile uint8_t *)data, size);
 }
 
 /** Use ISR to receive a string of character on I2C. 
@@ -67,99 +538,970 @@ void i2c_master_write(uint8_t addr, enum i2c_flag flag, volatile uint8_t * volat
  * The string must be saved in memory because it needs to be accessible in the ISR, hence be volatile. 
  * It is recommanded to use dedicated space to save the string, e.g., in global space. 
  * If the string is saved in stack, make sure it will not be overridden after current function returned prior the sring is fully sent. 
- * @param addr Slave address (0-127)
+ * @param i2c I2C object initialised by i2c_init()
+ * @param addr Slave address (0-127), or I2C_ADDR10() for 10-bit
  * @param flag ORed enum i2c_flag to set the behaviour of this transaction
  * @param data A pointer to the space to save the data, DO NOT remove the volatile qualifier
  * @param size Size of the string in bytes
  */
-void i2c_master_read(uint8_t addr, enum i2c_flag flag, volatile uint8_t * volatile data, uint16_t size) {
-	i2c.state = i2c_state_masterRead;
-	i2c.flag = flag;
-	i2c.deviceAddr = (addr << 1) | 1;
-	i2c.dataStart = data;
-	i2c.dataPtr = data;
-	i2c.dataEnd = data + size;
-	TWCR = (1 << TWINT) | (1 << TWSTA) | (1 << TWEN) | (1 << TWIE);
+void i2c_master_read(I2C * const i2c, i2c_addr addr, enum i2c_flag flag, volatile uint8_t * volatile data, uint16_t size) {
+	i2c->transaction = NULL;
+	i2c_beginAddr(i2c, addr, 1, flag, data, size, NULL, 0);
+	i2c_writeBitrate(i2c->sfrAddr, i2c->bitrate);
+	i2c->sfrAddr[SFR_TWCR] = (1 << TWINT) | (1 << TWSTA) | (1 << TWEN) | (1 << TWIE);
+}
+
+/** Use ISR to write a string of character then read a string of character on I2C in one transaction, e.g. write register address then read register value. 
+ * After the last byte is written, the ISR sends repeated START and the read address, then reads the data; the main program is not involved between the two phases. 
+ * When the transaction is finished, i2c_getState becomes i2c_state_free. Use i2c_progress() to check the progress. 
+ * Both strings must be saved in memory because they need to be accessible in the ISR, hence be volatile. 
+ * @param i2c I2C object initialised by i2c_init()
+ * @param addr Slave address (0-127), or I2C_ADDR10() for 10-bit
+ * @param flag ORed enum i2c_flag to set the behaviour of this transaction, i2c_flag_holdControl applies to the end of the read phase
+ * @param wdata A pointer to the data to send, DO NOT remove the volatile qualifier
+ * @param wsize Size of the string to send in bytes
+ * @param rdata A pointer to the space to save the data, DO NOT remove the volatile qualifier
+ * @param rsize Size of the string to read in bytes
+ */
+void i2c_master_writeRead(I2C * const i2c, i2c_addr addr, enum i2c_flag flag, volatile uint8_t * volatile wdata, uint16_t wsize, volatile uint8_t * volatile rdata, uint16_t rsize) {
+	i2c->transaction = NULL;
+	i2c_beginAddr(i2c, addr, 0, flag, wdata, wsize, rdata, rsize);
+	i2c_writeBitrate(i2c->sfrAddr, i2c->bitrate);
+	i2c->sfrAddr[SFR_TWCR] = (1 << TWINT) | (1 << TWSTA) | (1 << TWEN) | (1 << TWIE);
+}
+
+/* Load a scatter-gather write: the first segment as data, the others are loaded by the ISR. */
+static inline void i2c_beginGather(I2C * const i2c, const i2c_addr addr, const enum i2c_flag flag, const I2C_Segment * const segment, const uint16_t count) {
+	i2c_beginAddr(i2c, addr, 0, flag, segment->data, segment->size, NULL, 0);
+	i2c->segFirst = segment + 1;
+	i2c->segNext = segment + 1;
+	i2c->segEnd = segment + count;
+	for (const I2C_Segment * seg = segment + 1; seg != segment + count; seg++)
+		i2c->total += seg->size;
+}
+
+/** Use ISR to send several strings of character on I2C in one transaction (scatter-gather write). 
+ * The segments are sent back-to-back after one START and address, e.g. a segment of memory address followed by a segment of payload, 
+ * hence no staging buffer and no copy is needed. 
+ * When the transaction is finished, i2c_getState becomes i2c_state_free. Use i2c_progress() to check the progress. 
+ * @param i2c I2C object initialised by i2c_init()
+ * @param addr Slave address (0-127), or I2C_ADDR10() for 10-bit
+ * @param flag ORed enum i2c_flag to set the behaviour of this transaction
+ * @param segment Array of segments, must be stored in global space with the data it points to
+ * @param count Number of segments (at least 1)
+ */
+void i2c_master_writeGather(I2C * const i2c, i2c_addr addr, enum i2c_flag flag, const I2C_Segment * segment, uint16_t count) {
+	i2c->transaction = NULL;
+	i2c_beginGather(i2c, addr, flag, segment, count);
+	i2c_writeBitrate(i2c->sfrAddr, i2c->bitrate);
+	i2c->sfrAddr[SFR_TWCR] = (1 << TWINT) | (1 << TWSTA) | (1 << TWEN) | (1 << TWIE);
+}
+
+/* Read phase goes into a ring instead of a linear buffer. */
+static inline void i2c_beginRing(I2C * const i2c, I2C_Ring * const ring, const uint16_t size) {
+	i2c->ring = ring;
+	i2c->ringLeft = size;
+	i2c->ringSize = size;
+	i2c->total += size;
+}
+
+/** Use ISR to receive a string of character on I2C into a ring buffer (streaming read). 
+ * The application drains the ring with i2c_ringPop() while the read is in progress; if the ring is full, the bus is held until a byte is popped. 
+ * Keep I2C_TIMEOUT (if used) longer than the time the application may leave the ring full. 
+ * When the transaction is finished, i2c_getState becomes i2c_state_free. Use i2c_progress() to check the progress. 
+ * @param i2c I2C object initialised by i2c_init()
+ * @param addr Slave address (0-127), or I2C_ADDR10() for 10-bit
+ * @param flag ORed enum i2c_flag to set the behaviour of this transaction
+ * @param ring Ring initialised by i2c_ringInit()
+ * @param size Number of bytes to read (at least 1), can be larger than the ring
+ */
+void i2c_master_readRing(I2C * const i2c, i2c_addr addr, enum i2c_flag flag, I2C_Ring * ring, uint16_t size) {
+	i2c->transaction = NULL;
+	i2c_beginAddr(i2c, addr, 1, flag, NULL, 0, NULL, 0);
+	i2c_beginRing(i2c, ring, size);
+	i2c_writeBitrate(i2c->sfrAddr, i2c->bitrate);
+	i2c->sfrAddr[SFR_TWCR] = (1 << TWINT) | (1 << TWSTA) | (1 << TWEN) | (1 << TWIE);
+}
+
+/** Init a ring buffer for streaming read. 
+ * @param ring A ring object, must be defined in global space
+ * @param buffer Space of the ring, must be stored in global space, DO NOT remove the volatile qualifier
+ * @param size Size of the ring in bytes, power of 2 (2-128)
+ */
+void i2c_ringInit(I2C_Ring * const ring, volatile uint8_t * buffer, uint8_t size) {
+	ring->buffer = buffer;
+	ring->mask = size - 1;
+	ring->in = 0;
+	ring->out = 0;
+}
+
+/** Get number of bytes in the ring. 
+ * @param ring Ring initialised by i2c_ringInit()
+ * @return Number of bytes ready to pop
+ */
+uint8_t i2c_ringCount(const I2C_Ring * const ring) {
+	return ring->in - ring->out;
+}
+
+/** Pop a byte from the ring. 
+ * If the ISR is holding the bus because the ring was full, the read resumes. 
+ * @param i2c I2C object reading into the ring
+ * @param ring Ring initialised by i2c_ringInit()
+ * @param data Space to save the byte
+ * @return Non-zero if a byte is popped; 0 if the ring is empty
+ */
+uint8_t i2c_ringPop(I2C * const i2c, I2C_Ring * const ring, uint8_t * const data) {
+	uint8_t out = ring->out;
+	if (ring->in == out)
+		return 0;
+	*data = ring->buffer[out & ring->mask];
+	ring->out = out + 1;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		if (i2c->ringStall && i2c->ring == ring) {
+			i2c->ringStall = 0;
+			i2c->sfrAddr[SFR_TWCR] = (1 << TWINT) | (i2c->ringLeft > 1 ? (1 << TWEA) : 0) | (1 << TWEN) | (1 << TWIE);
+		}
+	}
+	return 1;
+}
+
+/* Make a transaction active and send START. 
+ * If the bus is held by previous transaction (i2c_flag_holdControl), this sends repeated START. */
+static inline void i2c_start(I2C * const i2c, volatile uint8_t * const sfr, I2C_Transaction * const t, const uint8_t twcr) {
+	i2c->transaction = t;
+	if (t->ring) {
+		if (t->dir == i2c_dir_writeRead) {
+			i2c_beginAddr(i2c, t->addr, 0, t->flag, t->data, t->size, NULL, 0);
+			i2c_beginRing(i2c, t->ring, t->readSize);
+		} else {
+			i2c_beginAddr(i2c, t->addr, 1, t->flag, NULL, 0, NULL, 0);
+			i2c_beginRing(i2c, t->ring, t->size);
+		}
+	} else if (t->dir == i2c_dir_writeRead)
+		i2c_beginAddr(i2c, t->addr, 0, t->flag, t->data, t->size, t->readData, t->readSize);
+	else if (t->dir == i2c_dir_writeGather)
+		i2c_beginGather(i2c, t->addr, t->flag, t->segment, t->size);
+	else
+		i2c_beginAddr(i2c, t->addr, t->dir, t->flag, t->data, t->size, NULL, 0);
+	t->state = i2c->state;
+	i2c_writeBitrate(sfr, t->bitrate ? t->bitrate : i2c->bitrate);
+	sfr[SFR_TWCR] = twcr;
+}
+
+/* Submit a transaction to the queue, without checking the presence cache. */
+static uint8_t i2c_enqueue(I2C * const i2c, I2C_Transaction * const t) {
+	volatile uint8_t * const sfr = i2c->sfrAddr;
+	uint8_t submitted = 0;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		uint8_t next = (i2c->queueIn + 1) & (I2C_QUEUE_SIZE - 1);
+		if ((i2c->state == i2c_state_free || i2c->state == i2c_state_error) && (!(sfr[SFR_TWCR] & (1 << TWINT)) || (i2c->flag & i2c_flag_holdControl))) { //TWINT set but not held: slave event pending, let the ISR start it
+			i2c_start(i2c, sfr, t, (1 << TWINT) | (1 << TWSTA) | (1 << TWEN) | (1 << TWIE) | i2c->slaveCtrl);
+			submitted = 1;
+		} else if (next != i2c->queueOut) {
+			t->state = i2c_state_queued;
+			i2c->queue[i2c->queueIn] = t;
+			i2c->queueIn = next;
+			submitted = 1;
+		}
+	}
+	return submitted;
+}
+
+/** Submit a transaction to the queue. 
+ * If I2C is free, the transaction starts immediately; otherwise, the ISR starts it when all transactions submitted before it end, 
+ * with repeated START if the previous one has i2c_flag_holdControl, or STOP then START if not. 
+ * Hence a batch of transactions runs back-to-back without the main program. 
+ * If the device (7-bit address) was found absent by the last i2c_scan(), the transaction fails fast without touching the bus: 
+ * it ends here with i2c_state_error and status i2c_status_absent, its done callback is called from this function. 
+ * Do not mix with i2c_master_write() and i2c_master_read() while the queue is not empty. 
+ * @param i2c I2C object initialised by i2c_init()
+ * @param t Transaction descriptor, must be stored in global space and not be modified until its state becomes i2c_state_free or i2c_state_error
+ * @return Non-zero if submitted (or failed fast); 0 if the queue is full
+ */
+uint8_t i2c_queue(I2C * const i2c, I2C_Transaction * const t) {
+	if (!i2c_getPresent(i2c, t->addr)) {
+		t->status = i2c_status_absent;
+		t->count = 0;
+		t->retry = 0;
+		t->state = i2c_state_error;
+		if (t->done)
+			t->done(t);
+		return 1;
+	}
+	return i2c_enqueue(i2c, t);
+}
+
+/* Probe the address in i2c->scanAddr: quick write (address only), or 1-byte read for EEPROM-like ranges where a write may change the device. */
+static inline uint8_t i2c_scanProbe(I2C * const i2c) {
+	uint8_t addr = i2c->scanAddr;
+	i2c->scan.addr = addr;
+	if ((addr & 0x78) == 0x30 || (addr & 0x70) == 0x50) { //0x30-0x37, 0x50-0x5F
+		i2c->scan.dir = i2c_dir_read;
+		i2c->scan.size = 1;
+	} else {
+		i2c->scan.dir = i2c_dir_write;
+		i2c->scan.size = 0;
+	}
+	return i2c_enqueue(i2c, &i2c->scan);
+}
+
+/* Done callback of the probe transaction, in the TWI ISR. 
+ * Address ACK or NAK gives the presence bit, then the next address is probed; other errors (bus error, timeout) probe the same address again, 
+ * at most I2C_SCAN_RETRY times, then the address is left present and counted as failed. */
+static void i2c_scanDone(I2C_Transaction * const t) {
+	I2C * i2c = (I2C *)((volatile uint8_t *)t - offsetof(I2C, scan));
+	uint8_t addr = i2c->scanAddr;
+	uint8_t bit = 1 << (addr & 7);
+	if (t->state == i2c_state_free) {
+		i2c->present[addr >> 3] |= bit;
+		addr++;
+	} else if (t->status == i2c_status_masterWrite_addrNak || t->status == i2c_status_masterRead_addrNak) {
+		i2c->present[addr >> 3] &= ~bit;
+		addr++;
+	} else if (i2c->scanRetry < I2C_SCAN_RETRY) {
+		i2c->scanRetry++;
+	} else { //Stuck or noisy bus, unknown: do not refuse the device
+		i2c->present[addr >> 3] |= bit;
+		i2c->scanFail++;
+		addr++;
+	}
+	if (addr != i2c->scanAddr)
+		i2c->scanRetry = 0;
+	i2c->scanAddr = addr < 0x78 ? addr : 0;
+	if (i2c->scanAddr && !i2c_scanProbe(i2c)) { //Queue full, scan ends: addresses not probed are unknown, left present and counted as failed
+		for (; addr < 0x78; addr++) {
+			i2c->present[addr >> 3] |= 1 << (addr & 7);
+			i2c->scanFail++;
+		}
+		i2c->scanAddr = 0;
+	}
+}
+
+/** Scan the bus in background, the result goes into the presence cache. 
+ * Each address 0x08 to 0x77 is probed by a transaction in the queue, interleaved with other transactions: 
+ * a quick write (address only, ACK or NAK), or a 1-byte read for 0x30-0x37 and 0x50-0x5F (EEPROM ranges, a quick write may change the state of some devices). 
+ * After the scan, i2c_queue() refuses transactions to absent devices immediately. Scan again after hot-plug. 
+ * Devices that NAK their address while busy (e.g. EEPROM in write cycle) are found absent, scan when they are idle. 
+ * An address that cannot be probed (bus error or timeout, I2C_SCAN_RETRY times again) is left present, see i2c_getScanFail(); hence a scan on a stuck bus ends. 
+ * If the queue is full when the next probe is due, the scan ends early, the remaining addresses are left present and counted in i2c_getScanFail() too. 
+ * @param i2c I2C object initialised by i2c_init()
+ * @return Non-zero if the scan is started; 0 if a scan is running or the queue is full
+ */
+uint8_t i2c_scan(I2C * const i2c) {
+	if (i2c->scanAddr)
+		return 0;
+	i2c->scan.flag = 0;
+	i2c->scan.data = &i2c->scanData;
+	i2c->scan.bitrate = 0;
+	i2c->scan.ring = NULL;
+	i2c->scan.done = i2c_scanDone;
+	uint8_t fail = i2c->scanFail;
+	i2c->scanRetry = 0;
+	i2c->scanFail = 0;
+	i2c->scanAddr = 0x08;
+	if (!i2c_scanProbe(i2c)) { //Not started, keep the result of the last scan
+		i2c->scanAddr = 0;
+		i2c->scanFail = fail;
+		return 0;
+	}
+	return 1;
+}
+
+/** Check if a scan is running. 
+ * @param i2c I2C object initialised by i2c_init()
+ * @return Non-zero if a scan is running
+ */
+uint8_t i2c_isScanning(const I2C * const i2c) {
+	return i2c->scanAddr;
+}
+
+/** Get the number of addresses the last scan could not probe. 
+ * These addresses got bus error or timeout on every probe, or were skipped because the queue was full, their presence is unknown and left present. 
+ * Non-zero after a scan indicates a bus problem, e.g. SDA or SCL stuck low, missing pull-up or noise. 
+ * @param i2c I2C object initialised by i2c_init()
+ * @return Number of addresses failed, valid when i2c_isScanning() returns 0
+ */
+uint8_t i2c_getScanFail(const I2C * const i2c) {
+	return i2c->scanFail;
+}
+
+/** Check the presence cache. 
+ * @param i2c I2C object initialised by i2c_init()
+ * @param addr Slave address (0-127), or I2C_ADDR10() for 10-bit
+ * @return Non-zero if the device answered the last scan, or has not been scanned (10-bit address, or out of range); 0 if found absent
+ */
+uint8_t i2c_getPresent(const I2C * const i2c, i2c_addr addr) {
+	if (addr > 0x7F) //Scan covers 7-bit addresses only
+		return 1;
+	return i2c->present[addr >> 3] & (1 << (addr & 7));
+}
+
+/** Get the presence cache. 
+ * @param i2c I2C object initialised by i2c_init()
+ * @return 16-byte bitmap, bit (addr & 7) of byte (addr >> 3) is set if the device is present (or not scanned)
+ */
+const volatile uint8_t * i2c_getPresentMap(const I2C * const i2c) {
+	return i2c->present;
+}
+
+/* End the active transaction. 
+ * Start the next one in the queue if any, with repeated START if the bus is held or STOP+START if the bus is released by twcr; 
+ * otherwise, release or hold the bus with twcr. */
+static inline void i2c_finish(I2C * const i2c, volatile uint8_t * const sfr, const enum i2c_state result, const uint8_t twcr) {
+	I2C_Transaction * t = i2c->transaction;
+	if (t) {
+		t->status = i2c->status;
+		t->count = i2c->total - i2c_getProgress(i2c);
+#ifdef I2C_SMBUS
+		t->count -= i2c->blockUnused;
+#endif
+		t->retry = i2c->retry;
+		t->state = result;
+		if (t->done)
+			t->done(t); //May submit another transaction, it is started below if the queue was empty
+	}
+
+	uint8_t out = i2c->queueOut;
+	if (out != i2c->queueIn) {
+		i2c->queueOut = (out + 1) & (I2C_QUEUE_SIZE - 1);
+		i2c_start(i2c, sfr, i2c->queue[out], (1 << TWINT) | (1 << TWSTA) | (twcr & (1 << TWSTO)) | (1 << TWEN) | (1 << TWIE) | i2c->slaveCtrl);
+	} else {
+		i2c->transaction = NULL;
+		i2c->state = i2c_state_free;
+		sfr[SFR_TWCR] = (twcr & (1 << TWINT)) ? twcr | i2c->slaveCtrl : twcr; //Keep listening as slave when the bus is released
+	}
+}
+
+/* Non-zero if the active transaction can restart from its first byte. 
+ * A streaming read cannot once a byte is in the ring, a restart would deliver the first bytes twice. */
+static inline uint8_t i2c_rewindable(const I2C * const i2c) {
+	return !i2c->ring || i2c->ringLeft == i2c->ringSize;
+}
+
+/* Rewind the active transaction to its first byte, used by retry and arbitration lost. */
+static inline void i2c_rewind(I2C * const i2c) {
+	i2c->deviceAddr = i2c->firstAddr;
+	i2c->state = (i2c->firstAddr & 1) ? i2c_state_masterRead : i2c_state_masterWrite;
+	if (i2c->transaction)
+		i2c->transaction->state = i2c->state;
+	i2c->dataPtr = i2c->dataStart;
+	i2c->dataEnd = i2c->firstEnd;
+	if (i2c->segEnd)
+		i2c->segNext = i2c->segFirst;
+	if (i2c->addr10)
+		i2c->addr10 = 1;
+	i2c->ringLeft = i2c->ringSize; //Nothing in the ring yet, see i2c_rewindable()
+	i2c->timeout = I2C_TIMEOUT;
+#ifdef I2C_CRC
+	i2c->crc = i2c->crcStart;
+#endif
+#ifdef I2C_SMBUS
+	i2c_smbusReset(i2c);
+#endif
+}
+
+/* Rewind the active transaction and write twcr to restart it. */
+static inline void i2c_restart(I2C * const i2c, volatile uint8_t * const sfr, const uint8_t twcr) {
+	i2c_rewind(i2c);
+	sfr[SFR_TWCR] = twcr;
+}
+
+/* Own master transaction lost arbitration: wait for the bus and restart it from its first byte, no retry counted. 
+ * twcr restarts it: with TWSTA, the hardware sends START as soon as the other master sends STOP. */
+static inline void i2c_lose(I2C * const i2c, volatile uint8_t * const sfr, const uint8_t twcr) {
+	i2c_rewind(i2c);
+	i2c->state = i2c_state_lost;
+	if (i2c->transaction)
+		i2c->transaction->state = i2c_state_lost;
+	sfr[SFR_TWCR] = twcr;
+}
+
+/* Addressed as slave by another master. 
+ * If own master transaction is waiting for the bus (START requested by i2c_queue() or the queue but not sent yet, or after arbitration lost), 
+ * or has just lost arbitration in its address byte to the master addressing us, 
+ * the hardware drops the pending START: rewind it and restart it when the slave transaction ends, instead of ending it as done. 
+ * A transaction waiting for retry backoff is restarted by i2c_tick() instead. 
+ * A streaming read with bytes in the ring never waits for the bus (no retry, no restart after arbitration lost), hence is always rewindable here. */
+static inline void i2c_slaveAddressed(I2C * const i2c) {
+	enum i2c_state state = i2c->state;
+	if ((state == i2c_state_masterWrite || state == i2c_state_masterRead || state == i2c_state_lost) && !i2c->backoff) {
+		i2c_rewind(i2c);
+		if (i2c->transaction)
+			i2c->transaction->state = i2c_state_lost;
+		i2c->lost = 1;
+	}
+	i2c->state = i2c_state_slave;
+}
+
+/* The active transaction failed (arbitration lost, address NAK or bus error), twcr releases the bus. 
+ * Retry it if flaged i2c_flag_retry and retry count not exceeded, otherwise end it with error. */
+static inline void i2c_fail(I2C * const i2c, volatile uint8_t * const sfr, uint8_t twcr) {
+	if ((i2c->flag & i2c_flag_retry) && i2c->retry < I2C_RETRY_MAX && i2c_rewindable(i2c)) {
+		i2c->retry++;
+#if I2C_RETRY_BACKOFF
+		i2c->backoff = (uint16_t)I2C_RETRY_BACKOFF << (i2c->retry - 1);
+		sfr[SFR_TWCR] = twcr | i2c->slaveCtrl; //Release the bus, i2c_tick() restarts the transaction
+#else
+		if (i2c->status == i2c_status_error) { //Recover internal hardware first, then START on a clean state
+			sfr[SFR_TWCR] = twcr;
+			twcr = (1 << TWINT) | (1 << TWEN);
+		}
+		i2c_restart(i2c, sfr, twcr | (1 << TWSTA) | (1 << TWIE) | i2c->slaveCtrl); //STOP (if in twcr) then START
+#endif
+	} else {
+		i2c_finish(i2c, sfr, i2c_state_error, twcr);
+	}
+}
+
+/** Put this function in a timer ISR if I2C_RETRY_BACKOFF or I2C_TIMEOUT is not 0. 
+ * It counts down the retry backoff and restarts the transaction when expired; 
+ * it also counts down the transaction timeout and clears the bus when expired. 
+ * The tick period is the unit of I2C_RETRY_BACKOFF and I2C_TIMEOUT, e.g. a 1kHz timer gives 1ms. 
+ * @param i2c I2C object initialised by i2c_init()
+ */
+void i2c_tick(I2C * const i2c) {
+	volatile uint8_t * const sfr = i2c->sfrAddr;
+	if (i2c->backoff) {
+		if (!--i2c->backoff) {
+			if (i2c->state == i2c_state_slave) //Addressed as slave in the meantime, try again next tick
+				i2c->backoff = 1;
+			else
+				i2c_restart(i2c, sfr, (1 << TWINT) | (1 << TWSTA) | (1 << TWEN) | (1 << TWIE) | i2c->slaveCtrl);
+		}
+		return;
+	}
+#if I2C_TIMEOUT
+	if (i2c->timeout && !--i2c->timeout && (i2c->state == i2c_state_masterWrite || i2c->state == i2c_state_masterRead)) {
+		i2c_busClear(i2c);
+		i2c->status = i2c_status_timeout;
+		i2c_finish(i2c, sfr, i2c_state_error, (1 << TWEN) | i2c->slaveCtrl); //Start next queued transaction if any
+		if (i2c->state == i2c_state_free)
+			i2c->state = i2c_state_error;
+	}
+#endif
+}
+
+/** Enable auto slave mode with register-map emulation. 
+ * The device answers to addr and exposes a register file to other masters, everything is handled in the ISR: 
+ * - Master write: the first byte is the register pointer, following bytes are written to the registers with auto-increment, only bits set in the write mask are changed; 
+ * - Master read: bytes are read from the register pointer with auto-increment, use a write with only the pointer byte then repeated START to select the register. 
+ * The register pointer wraps to 0 after the last register. 
+ * Master transactions can still be used; a transaction submitted by i2c_queue() while addressed as slave starts when the slave transaction ends. 
+ * Do not use i2c_master_write/read() in this mode, they start immediately and may break an ongoing slave transaction. 
+ * Call i2c_init() first. 
+ * @param i2c I2C object initialised by i2c_init()
+ * @param addr Own slave address (0-127)
+ * @param regs Register file, DO NOT remove the volatile qualifier
+ * @param mask Write mask of each register, in flash (PROGMEM); NULL if all bits of all registers are writable
+ * @param size Number of registers (1-255)
+ * @param callback Function called in the ISR when a master write ends, NULL if not used
+ */
+void i2c_slave_init(I2C * const i2c, uint8_t addr, volatile uint8_t * regs, const uint8_t * mask, uint8_t size, i2c_slaveCallback callback) {
+	volatile uint8_t * const sfr = i2c->sfrAddr;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		i2c->slaveRegs = regs;
+		i2c->slaveMask = mask;
+		i2c->slaveSize = size;
+		i2c->slavePtr = 0;
+		i2c->slaveCallback = callback;
+		i2c->slaveCtrl = (1 << TWEA) | (1 << TWIE);
+		sfr[SFR_TWAR] = (addr << 1) | (sfr[SFR_TWAR] & (1 << TWGCE)); //Keep general call setting
+		if (i2c->state == i2c_state_free && !(sfr[SFR_TWCR] & (1 << TWINT)))
+			sfr[SFR_TWCR] = (1 << TWEN) | i2c->slaveCtrl;
+	}
+}
+
+/** Disable auto slave mode. 
+ * The device stops answering to its slave address after current slave transaction. 
+ * @param i2c I2C object initialised by i2c_init()
+ */
+void i2c_slave_disable(I2C * const i2c) {
+	volatile uint8_t * const sfr = i2c->sfrAddr;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		i2c->slaveCtrl = 0;
+		if (i2c->state == i2c_state_free && !(sfr[SFR_TWCR] & (1 << TWINT)))
+			sfr[SFR_TWCR] = (1 << TWEN);
+	}
+}
+
+/** Answer to general call (address 0) in auto slave mode. 
+ * A general call write is a broadcast to all slaves, handled like a write to own address: the first byte is the register pointer, the following bytes are written to the registers. 
+ * Hence one broadcast write from the master updates all slaves at the same time, e.g. a sync or latch register. 
+ * Note that the I2C spec reserves first byte 0x06 (reset and write programmable address) and 0x04 (write programmable address), avoid them as register pointer on a mixed bus. 
+ * Call i2c_slave_init() first. 
+ * @param i2c I2C object initialised by i2c_init()
+ * @param enable Non-zero to answer general call, 0 to ignore it
+ */
+void i2c_slave_generalCall(I2C * const i2c, uint8_t enable) {
+	volatile uint8_t * const sfr = i2c->sfrAddr;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		sfr[SFR_TWAR] = (sfr[SFR_TWAR] & ~(1 << TWGCE)) | (enable ? (1 << TWGCE) : 0);
+	}
 }
 
 /** Get current I2C status (from I2C hardware). 
+ * @param i2c I2C object initialised by i2c_init()
  * @return Current status
  */
-enum i2c_status i2c_getStatus() {
-	return i2c.status;
+enum i2c_status i2c_getStatus(const I2C * const i2c) {
+	return i2c->status;
 }
 
 /** Get current I2C state (from software register). 
+ * @param i2c I2C object initialised by i2c_init()
  * @return Current state
  */
-enum i2c_state i2c_getState() {
-	return i2c.state;
+enum i2c_state i2c_getState(const I2C * const i2c) {
+	return i2c->state;
 }
 
 /** Get number of character left to write or read. 
+ * For write-then-read transaction, this includes both phases; for scatter-gather write, this includes all segments left; for streaming read, this includes bytes not in the ring yet. 
  * Non-zero value when i2c_getState is i2c_state_free indicates error. Use i2c_getStatus() to analysis. 
+ * @param i2c I2C object initialised by i2c_init()
  * @return Number of character left to send or read, in bytes
  */
-uint16_t i2c_getProgress() {
-	return i2c.dataEnd - i2c.dataPtr;
+uint16_t i2c_getProgress(const I2C * const i2c) {
+	uint16_t left = i2c->dataEnd - i2c->dataPtr;
+	for (const I2C_Segment * seg = i2c->segNext; seg != i2c->segEnd; seg++) //Segments not loaded yet
+		left += seg->size;
+	left += i2c->ringLeft;
+	if (!(i2c->deviceAddr & 1)) //Read phase not started yet
+		left += i2c->readEnd - i2c->readStart;
+	return left;
+}
+
+/** Wait until current transaction finished, instead of busy-polling i2c_getState(). 
+ * The CPU is put in IDLE sleep between interrupts; the state is checked with interrupt disabled 
+ * and the CPU goes to sleep in the instruction right after SEI, hence a wake-up interrupt cannot be missed. 
+ * This function sets the sleep mode to IDLE and enables global interrupt. 
+ * @param i2c I2C object initialised by i2c_init()
+ * @param timeout Address of a counter decremented by the application in a timer ISR, give up when it reaches 0; NULL to wait without timeout
+ * @return Non-zero if I2C is idle; 0 if timed out
+ */
+uint8_t i2c_waitIdle(const I2C * const i2c, volatile const uint16_t * const timeout) {
+	uint8_t idle;
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	for (;;) {
+		cli();
+		idle = i2c->state == i2c_state_free || i2c->state == i2c_state_error || i2c->state == i2c_state_unknown;
+		if (idle || (timeout && !*timeout))
+			break;
+		sleep_enable();
+		sei(); //The instruction after SEI is always executed before any pending interrupt
+		sleep_cpu();
+		sleep_disable();
+	}
+	sei();
+	return idle;
+}
+
+/* Wait until a queued transaction ends, with IDLE sleep. 
+ * Returns non-zero if it ended without error. */
+static inline uint8_t i2c_waitTransaction(I2C_Transaction * const t) {
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	for (;;) {
+		cli();
+		if (t->state == i2c_state_free || t->state == i2c_state_error)
+			break;
+		sleep_enable();
+		sei(); //The instruction after SEI is always executed before any pending interrupt
+		sleep_cpu();
+		sleep_disable();
+	}
+	sei();
+	return t->state == i2c_state_free;
+}
+
+/** Execute an init script stored in flash, see I2C_SCRIPT_END for the format. 
+ * Each record is submitted to the transaction queue as a flash write with i2c_flag_retry, the data is never copied into SRAM. 
+ * Records without delay are queued ahead (two transactions in flight), so they run back-to-back in the ISR; 
+ * a record with delay is waited for, then the delay is done with busy-wait. 
+ * This function blocks until the script ends or a record fails, it sets the sleep mode to IDLE and enables global interrupt. 
+ * Not reentrant: do not call from ISR, nor for two I2C objects at the same time. 
+ * @param i2c I2C object initialised by i2c_init()
+ * @param script Address of the script in flash
+ * @return Non-zero if all records are written; 0 if one failed, the rest of the script is skipped
+ */
+uint8_t i2c_script(I2C * const i2c, const uint8_t * script) {
+	static I2C_Transaction t[2];
+	uint8_t n = 0;
+	t[0].state = i2c_state_free;
+	t[1].state = i2c_state_free;
+	for (;;) {
+		I2C_Transaction * tx = &t[n++ & 1];
+		if (!i2c_waitTransaction(tx)) { //Record submitted two records before failed
+			i2c_waitTransaction(&t[n & 1]); //Let the other one end, the ISR still uses its descriptor
+			return 0;
+		}
+
+		uint8_t addr = pgm_read_byte(script++);
+		if (addr == I2C_SCRIPT_END)
+			return i2c_waitTransaction(&t[n & 1]);
+		uint8_t len = pgm_read_byte(script++);
+		tx->addr = addr;
+		tx->dir = i2c_dir_write;
+		tx->flag = i2c_flag_progmem | i2c_flag_retry;
+		tx->data = (volatile uint8_t *)script;
+		tx->size = len;
+		tx->bitrate = 0;
+		script += len;
+		uint8_t delay = pgm_read_byte(script++);
+		while (!i2c_queue(i2c, tx)); //Queue full, wait for the ISR
+
+		if (delay) {
+			if (!i2c_waitTransaction(tx)) //The record before it has ended too
+				return 0;
+			while (delay--)
+				_delay_ms(1);
+		}
+	}
+}
+
+#ifdef I2C_CRC
+/** Get the running CRC. 
+ * Read it when i2c_getState() is i2c_state_free, the ISR updates it during transaction. 
+ * @param i2c I2C object initialised by i2c_init()
+ * @return Running CRC of all data bytes written or read since last i2c_crcReset()
+ */
+i2c_crc i2c_getCrc(const I2C * const i2c) {
+	return i2c->crc;
+}
+
+/** Reset the running CRC. 
+ * @param i2c I2C object initialised by i2c_init()
+ * @param init Initial value of the CRC, e.g. crc_smbus8_init
+ */
+void i2c_crcReset(I2C * const i2c, i2c_crc init) {
+	i2c->crc = init;
+}
+#endif
+
+/* Master read: ACK the next byte unless it is the last one on the wire (the PEC byte with i2c_flag_pec); ptr is where the next byte goes. */
+static inline uint8_t i2c_readAck(I2C * const i2c, volatile uint8_t * const ptr) {
+#ifdef I2C_SMBUS
+	if (i2c->blockError)
+		return 0;
+	if (i2c->flag & i2c_flag_pec)
+		return ptr != i2c->dataEnd ? (1 << TWEA) : 0;
+#endif
+	return ptr + 1 != i2c->dataEnd ? (1 << TWEA) : 0;
+}
+
+#ifdef I2C_SMBUS
+/* Block read: the byte count is received, the data follows it at ptr; end the read after the data. */
+static inline void i2c_blockCount(I2C * const i2c, volatile uint8_t * const ptr, const uint8_t count) {
+	i2c->blockCount = 0;
+	if (!count || count > i2c->dataEnd - ptr) {
+		i2c->blockError = 1;
+	} else {
+		i2c->blockUnused = (i2c->dataEnd - ptr) - count; //Restored by i2c_smbusReset() on retry
+		i2c->dataEnd = ptr + count;
+	}
 }
+#endif
 
+/* Streaming read: store the byte received into the ring, the ring has space (checked by i2c_ringNext() before the byte is requested). */
+static inline uint8_t i2c_ringPush(I2C * const i2c, volatile uint8_t * const sfr) {
+	I2C_Ring * ring = i2c->ring;
+	uint8_t in = ring->in;
+	uint8_t data = sfr[SFR_TWDR];
+	ring->buffer[in & ring->mask] = data;
+	ring->in = in + 1;
+	i2c->ringLeft--;
+	return data;
+}
 
+/* Streaming read: request next byte, ACK if not the last one; 
+ * if the ring is full, hold the bus (TWINT not cleared) with interrupt disabled, i2c_ringPop() resumes. */
+static inline void i2c_ringNext(I2C * const i2c, volatile uint8_t * const sfr) {
+	I2C_Ring * ring = i2c->ring;
+	if ((uint8_t)(ring->in - ring->out) > ring->mask) {
+		i2c->ringStall = 1;
+		sfr[SFR_TWCR] = (1 << TWEN);
+	} else {
+		sfr[SFR_TWCR] = (1 << TWINT) | (i2c->ringLeft > 1 ? (1 << TWEA) : 0) | (1 << TWEN) | (1 << TWIE);
+	}
+}
 
-ISR(TWI_vect) {
-	i2c.status = TWSR & 0xF8;
-	switch (TWSR & 0xF8) {
-		case i2c_status_master_start:
-		case i2c_status_master_repeatedStart:
-			TWDR = i2c.deviceAddr;
-			TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWIE);
+/** TWI interrupt handler, emitted in the vector by I2C_ISR(). 
+ * Always inlined, so the object and the register base are constants. 
+ * TWSR is read once and the status code shifted right by 3 (0x00-0xF8 to 0-31), so the compiler builds a jump table instead of a compare chain. 
+ * The data pointer is loaded once per interrupt into registers and written back once. 
+ * No cycle count per status is given here: the cost of each path depends on the compiler version, the optimisation level and the features in use 
+ * (I2C_CRC, I2C_SMBUS and PEC, scatter-gather, flash data, ring, 10-bit address, done callbacks). 
+ * Measure it on your build: in the listing (avr-objdump -d), add the cycles from the vector entry through the case of the status to reti, plus 4 for the interrupt response. 
+ * A slow ISR does not lose data on the TWI side, the hardware holds SCL low until TWINT is cleared; 
+ * but it delays other interrupts, e.g. a USART receiver has only a 2-byte buffer: at 16MHz, a 1Mbaud UART frame takes 160 cycles. 
+ */
+static inline __attribute__((always_inline)) void i2c_isr(I2C * const i2c, volatile uint8_t * const sfr) {
+	uint8_t status = sfr[SFR_TWSR] & 0xF8;
+	i2c->status = status;
+#ifdef I2C_SMBUS
+	i2c->timeout = I2C_TIMEOUT; //Clock low timeout: time since the last bus event
+#endif
+	switch (status >> 3) {
+		case i2c_status_master_start >> 3:
+			if (i2c->state == i2c_state_lost) { //Bus won after arbitration lost
+				i2c->state = (i2c->firstAddr & 1) ? i2c_state_masterRead : i2c_state_masterWrite;
+				if (i2c->transaction)
+					i2c->transaction->state = i2c->state;
+				i2c->timeout = I2C_TIMEOUT;
+			}
+			//Fall through to send address
+		case i2c_status_master_repeatedStart >> 3:
+			sfr[SFR_TWDR] = i2c->deviceAddr;
+			sfr[SFR_TWCR] = (1 << TWINT) | (1 << TWEN) | (1 << TWIE);
+		#ifdef I2C_SMBUS
+			if (i2c->flag & i2c_flag_pec)
+				i2c->pec = crc_smbus8(i2c->pec, i2c->deviceAddr);
+		#endif
 			break;
 		
-		case i2c_status_masterWrite_addrAck:
-		case i2c_status_masterWrite_addrNak:
-		case i2c_status_masterWrite_dataAck:
-		case i2c_status_masterWrite_dataNak:
-			if (i2c.dataPtr != i2c.dataEnd) { //Transmiit in progress
-				TWDR = *(i2c.dataPtr++);
-				TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWIE);
-			} else{ //All bytes sent
-				i2c.state = i2c_state_free;
-				if (i2c.flag & i2c_flag_holdControl) {
-					TWCR = (1 << TWEN); //Only send the data and disable interrupt, do not clear INT flag so the hardware holds the bus
-				} else {
-					TWCR = (1 << TWINT) | (1 << TWSTO) | (1 << TWEN); //Stop to release bus, disable interrupt to end transaction
+		case i2c_status_masterWrite_addrNak >> 3:
+			i2c_fail(i2c, sfr, (1 << TWINT) | (1 << TWSTO) | (1 << TWEN));
+			break;
+		case i2c_status_masterWrite_dataNak >> 3:
+			if (i2c->addr10 == 2 && i2c->dataPtr == i2c->dataStart) { //No 10-bit slave answered A7-A0 (no data byte sent yet), same as address NAK
+				i2c_fail(i2c, sfr, (1 << TWINT) | (1 << TWSTO) | (1 << TWEN));
+				break;
+			}
+		#ifdef I2C_SMBUS
+			if (i2c->flag & i2c_flag_pec) { //Slave refused data, or the PEC
+				i2c_finish(i2c, sfr, i2c_state_error, (1 << TWINT) | (1 << TWSTO) | (1 << TWEN));
+				break;
+			}
+		#endif
+			if (i2c->dataPtr != i2c->dataEnd || i2c->segNext != i2c->segEnd) { //Slave refused data before the last byte
+				i2c_finish(i2c, sfr, i2c_state_error, (1 << TWINT) | (1 << TWSTO) | (1 << TWEN));
+				break;
+			}
+			//NAK of the last byte is accepted, fall through
+		case i2c_status_masterWrite_addrAck >> 3:
+			if (i2c->addr10 == 1) { //10-bit address, send A7-A0 before the data
+				uint8_t low = i2c->addrLow;
+				sfr[SFR_TWDR] = low;
+				sfr[SFR_TWCR] = (1 << TWINT) | (1 << TWEN) | (1 << TWIE);
+				i2c->addr10 = 2;
+			#ifdef I2C_SMBUS
+				if (i2c->flag & i2c_flag_pec)
+					i2c->pec = crc_smbus8(i2c->pec, low);
+			#endif
+				break;
+			}
+			//Fall through to send data
+		case i2c_status_masterWrite_dataAck >> 3:
+			{
+				volatile uint8_t * ptr = i2c->dataPtr;
+				if (ptr == i2c->dataEnd && i2c->segNext != i2c->segEnd) { //Scatter-gather write, load next non-empty segment
+					const I2C_Segment * seg = i2c->segNext;
+					volatile uint8_t * end;
+					do {
+						ptr = seg->data;
+						end = ptr + seg->size;
+						seg++;
+					} while (ptr == end && seg != i2c->segEnd);
+					i2c->segNext = seg;
+					i2c->dataEnd = end;
+				}
+				if (ptr != i2c->dataEnd) { //Transmiit in progress
+					uint8_t data = (i2c->flag & i2c_flag_progmem) ? pgm_read_byte((const uint8_t *)ptr) : *ptr;
+					ptr++;
+					sfr[SFR_TWDR] = data;
+					sfr[SFR_TWCR] = (1 << TWINT) | (1 << TWEN) | (1 << TWIE);
+					i2c->dataPtr = ptr;
+				#ifdef I2C_CRC
+					i2c->crc = I2C_CRC(i2c->crc, data); //After TWCR, the CRC is calculated while the byte is being sent
+				#endif
+				#ifdef I2C_SMBUS
+					if (i2c->flag & i2c_flag_pec)
+						i2c->pec = crc_smbus8(i2c->pec, data);
+				#endif
+				} else if (i2c->readStart != i2c->readEnd || i2c->ring) { //All bytes sent, read phase follows
+					i2c->state = i2c_state_masterRead;
+					if (i2c->transaction)
+						i2c->transaction->state = i2c_state_masterRead;
+					i2c->deviceAddr |= 1;
+					i2c->dataPtr = i2c->readStart;
+					i2c->dataEnd = i2c->readEnd;
+					sfr[SFR_TWCR] = (1 << TWINT) | (1 << TWSTA) | (1 << TWEN) | (1 << TWIE); //Repeated START, then send read address in i2c_status_master_repeatedStart
+			#ifdef I2C_SMBUS
+				} else if ((i2c->flag & i2c_flag_pec) && !i2c->pecSent) { //All bytes sent, append PEC
+					i2c->pecSent = 1;
+					sfr[SFR_TWDR] = i2c->pec;
+					sfr[SFR_TWCR] = (1 << TWINT) | (1 << TWEN) | (1 << TWIE);
+			#endif
+				} else { //All bytes sent
+					if (i2c->flag & i2c_flag_holdControl) {
+						i2c_finish(i2c, sfr, i2c_state_free, (1 << TWEN)); //Only send the data and disable interrupt, do not clear INT flag so the hardware holds the bus
+					} else {
+						i2c_finish(i2c, sfr, i2c_state_free, (1 << TWINT) | (1 << TWSTO) | (1 << TWEN)); //Stop to release bus, disable interrupt to end transaction
+					}
 				}
 			}
 			break;
 		
-		case i2c_status_masterRead_addrAck:
-			TWCR = (1 << TWINT) | ((i2c.dataPtr != (i2c.dataEnd-1) ? 1 : 0) << TWEA) | (1 << TWEN) | (1 << TWIE); //If last byte, return NAK when receive the data to inform the slave stopping sending data
+		case i2c_status_masterRead_addrAck >> 3:
+			if (i2c->ring) {
+				i2c_ringNext(i2c, sfr);
+				break;
+			}
+			sfr[SFR_TWCR] = (1 << TWINT) | i2c_readAck(i2c, i2c->dataPtr) | (1 << TWEN) | (1 << TWIE); //If last byte, return NAK when receive the data to inform the slave stopping sending data
 			break;
-		case i2c_status_masterRead_addrNak:
-			i2c.state = i2c_state_free;
-			TWCR = (1 << TWINT) | (1 << TWSTO) | (1 << TWEN); //Error: Stop and release the bus
+		case i2c_status_masterRead_addrNak >> 3:
+			i2c_fail(i2c, sfr, (1 << TWINT) | (1 << TWSTO) | (1 << TWEN)); //Error: Stop and release the bus
 			break;
-		case i2c_status_masterRead_dataAck:
-			*(i2c.dataPtr++) = TWDR;
-			TWCR = (1 << TWINT) | ((i2c.dataPtr != (i2c.dataEnd-1) ? 1 : 0) << TWEA) | (1 << TWEN) | (1 << TWIE);
+		case i2c_status_masterRead_dataAck >> 3:
+			if (i2c->ring) {
+				uint8_t data = i2c_ringPush(i2c, sfr);
+				i2c_ringNext(i2c, sfr);
+			#ifdef I2C_CRC
+				i2c->crc = I2C_CRC(i2c->crc, data);
+			#endif
+				(void)data;
+				break;
+			}
+			{
+				volatile uint8_t * ptr = i2c->dataPtr;
+				uint8_t data = sfr[SFR_TWDR];
+				*(ptr++) = data;
+			#ifdef I2C_SMBUS
+				if (i2c->blockCount)
+					i2c_blockCount(i2c, ptr, data);
+			#endif
+				sfr[SFR_TWCR] = (1 << TWINT) | i2c_readAck(i2c, ptr) | (1 << TWEN) | (1 << TWIE);
+				i2c->dataPtr = ptr;
+			#ifdef I2C_CRC
+				i2c->crc = I2C_CRC(i2c->crc, data); //After TWCR, the CRC is calculated while the next byte is being received
+			#endif
+			#ifdef I2C_SMBUS
+				if (i2c->flag & i2c_flag_pec)
+					i2c->pec = crc_smbus8(i2c->pec, data);
+			#endif
+			}
 			break;
-		case i2c_status_masterRead_dataNak:
-			*(i2c.dataPtr++) = TWDR;
-			i2c.state = i2c_state_free;
-			if (i2c.flag & i2c_flag_holdControl) {
-				TWCR = (1 << TWEN); //Only read the data and disable interrupt, do not clear INT flag so the hardware holds the bus
+		case i2c_status_masterRead_dataNak >> 3:
+			if (i2c->ring) {
+				uint8_t data = i2c_ringPush(i2c, sfr);
+			#ifdef I2C_CRC
+				i2c->crc = I2C_CRC(i2c->crc, data);
+			#endif
+				(void)data;
 			} else {
-				TWCR = (1 << TWINT) | (1 << TWSTO) | (1 << TWEN); //Stop to release bus, disable interrupt to end transaction
+				volatile uint8_t * ptr = i2c->dataPtr;
+				uint8_t data = sfr[SFR_TWDR];
+			#ifdef I2C_SMBUS
+				if (i2c->blockError || ((i2c->flag & i2c_flag_pec) && data != i2c->pec)) { //Block count refused, or PEC mismatch
+					i2c->status = i2c->blockError ? i2c_status_blockError : i2c_status_pecError;
+					i2c_fail(i2c, sfr, (1 << TWINT) | (1 << TWSTO) | (1 << TWEN));
+					break;
+				}
+				if (!(i2c->flag & i2c_flag_pec)) //PEC byte is not stored
+			#endif
+				{
+					*(ptr++) = data;
+					i2c->dataPtr = ptr;
+				#ifdef I2C_CRC
+					i2c->crc = I2C_CRC(i2c->crc, data);
+				#endif
+				}
+			}
+			if (i2c->flag & i2c_flag_holdControl) {
+				i2c_finish(i2c, sfr, i2c_state_free, (1 << TWEN)); //Only read the data and disable interrupt, do not clear INT flag so the hardware holds the bus
+			} else {
+				i2c_finish(i2c, sfr, i2c_state_free, (1 << TWINT) | (1 << TWSTO) | (1 << TWEN)); //Stop to release bus, disable interrupt to end transaction
 			}
 			break;
 		
-		case i2c_status_error:
-			i2c.state = i2c_state_free;
-			TWCR = (1 << TWINT) | (1 << TWSTO) | (1 << TWEN); //Reset internal hardware
+		case i2c_status_slaveReceive_lostAddrAck >> 3:
+		case i2c_status_slaveTransmit_lostAddrAck >> 3:
+		case i2c_status_slaveReceive_lostGeneralAck >> 3:
+			//Own master transaction lost arbitration, restarted when the slave transaction ends, see i2c_slaveAddressed()
+			if (status == i2c_status_slaveTransmit_lostAddrAck)
+				goto slaveTransmit;
+			//Fall through to slave receiver
+		case i2c_status_slaveReceive_addrAck >> 3:
+		case i2c_status_slaveReceive_generalAck >> 3: //General call is a broadcast write to the register file
+			i2c_slaveAddressed(i2c);
+			i2c->slavePtrNext = 1;
+			i2c->slaveWriteCount = 0;
+			sfr[SFR_TWCR] = (1 << TWINT) | (1 << TWEA) | (1 << TWEN) | (1 << TWIE);
+			break;
+		case i2c_status_slaveReceive_dataAck >> 3:
+		case i2c_status_slaveReceive_generalDataAck >> 3:
+			{
+				uint8_t data = sfr[SFR_TWDR];
+				uint8_t ptr = i2c->slavePtr;
+				if (i2c->slavePtrNext) {
+					i2c->slavePtrNext = 0;
+					ptr = data < i2c->slaveSize ? data : 0;
+					i2c->slavePtr = ptr;
+					i2c->slaveWriteReg = ptr;
+				} else {
+					volatile uint8_t * reg = i2c->slaveRegs + ptr;
+					uint8_t mask = i2c->slaveMask ? pgm_read_byte(i2c->slaveMask + ptr) : 0xFF;
+					*reg = (*reg & ~mask) | (data & mask);
+					i2c->slavePtr = (++ptr < i2c->slaveSize) ? ptr : 0;
+					i2c->slaveWriteCount++;
+				}
+			}
+			sfr[SFR_TWCR] = (1 << TWINT) | (1 << TWEA) | (1 << TWEN) | (1 << TWIE);
+			break;
+		case i2c_status_slave_stop >> 3:
+			if (i2c->slaveWriteCount && i2c->slaveCallback)
+				i2c->slaveCallback(i2c->slaveWriteReg, i2c->slaveWriteCount);
+			//Fall through to end of slave transaction
+		case i2c_status_slaveReceive_dataNak >> 3:
+		case i2c_status_slaveReceive_generalDataNak >> 3:
+		case i2c_status_slaveTransmit_dataNak >> 3:
+		case i2c_status_slaveTransmit_lastAck >> 3:
+			i2c->slaveWriteCount = 0;
+			if (i2c->backoff) { //Master transaction waiting for retry, i2c_tick() restarts it
+				i2c->state = (i2c->firstAddr & 1) ? i2c_state_masterRead : i2c_state_masterWrite;
+				sfr[SFR_TWCR] = (1 << TWINT) | (1 << TWEN) | i2c->slaveCtrl;
+			} else if (i2c->lost) { //Master transaction lost arbitration to the master addressing us, START when the bus is free
+				i2c->lost = 0;
+				i2c->state = i2c_state_lost;
+				sfr[SFR_TWCR] = (1 << TWINT) | (1 << TWSTA) | (1 << TWEN) | (1 << TWIE) | i2c->slaveCtrl;
+			} else {
+				i2c_finish(i2c, sfr, i2c_state_free, (1 << TWINT) | (1 << TWEN)); //Not addressed anymore, start queued master transaction if any
+			}
+			break;
+		case i2c_status_slaveTransmit_addrAck >> 3:
+		slaveTransmit:
+			i2c_slaveAddressed(i2c);
+			//Fall through to send first byte
+		case i2c_status_slaveTransmit_dataAck >> 3:
+			{
+				uint8_t ptr = i2c->slavePtr;
+				sfr[SFR_TWDR] = i2c->slaveRegs[ptr];
+				sfr[SFR_TWCR] = (1 << TWINT) | (1 << TWEA) | (1 << TWEN) | (1 << TWIE);
+				i2c->slavePtr = (++ptr < i2c->slaveSize) ? ptr : 0;
+			}
+			break;
+
+		case i2c_status_master_lost >> 3:
+			if (i2c_rewindable(i2c))
+				i2c_lose(i2c, sfr, (1 << TWINT) | (1 << TWSTA) | (1 << TWEN) | (1 << TWIE) | i2c->slaveCtrl); //Bus released by hardware, START when the bus is free; addressed slave mode meanwhile if enabled
+			else
+				i2c_finish(i2c, sfr, i2c_state_error, (1 << TWINT) | (1 << TWEN)); //Streaming read with bytes in the ring, cannot restart
+			break;
+		case i2c_status_error >> 3:
+			i2c_fail(i2c, sfr, (1 << TWINT) | (1 << TWSTO) | (1 << TWEN)); //Reset internal hardware
 			break;
 		default:
 			/* Error? */
-			i2c.state = i2c_state_free;
-			TWCR = (1 << TWINT) | (1 << TWEN); //Just clear the I flag
+			i2c_finish(i2c, sfr, i2c_state_error, (1 << TWINT) | (1 << TWEN)); //Just clear the I flag
 	}
-}
\ No newline at end of file
+}
+
+#undef SFR_TWAMR
+#undef SFR_TWCR
+#undef SFR_TWDR
+#undef SFR_TWAR
+#undef SFR_TWSR
+#undef SFR_TWBR
+
+#endif /*#ifndef I2C_EXTERN*/
+
+#endif /*#ifndef I2C_H*/
\ No newline at end of file
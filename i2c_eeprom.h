@@ -0,0 +1,201 @@
+/** AVR I2C EEPROM lib 
+ * This library drives 24LCxx/24Cxx serial EEPROM over the transaction queue of i2c.h: 
+ * - Write: data of any length is split on page boundaries, each page is one scatter-gather transaction (memory address + data, no copy); and 
+ * - Write cycle: completion is detected by ACK polling in the TWI ISR (the device NAKs its address while busy), no fixed delay; 
+ *   the write cycle of the last page is polled too, so a finished write job is in the memory; and 
+ * - Read: sequential read of any length in one write-then-read transaction. 
+ * Everything runs in the TWI ISR, the application only starts a job and checks its state. 
+ * Needs i2c.h, include i2c.h first. 
+ */
+
+#ifndef I2C_EEPROM_H
+#define I2C_EEPROM_H
+
+#include "i2c.h"
+
+/** Max number of address polls while waiting for a write cycle, before giving up with error. 
+ * Each poll is START, address, NAK, STOP: about 10 SCL periods, i.e. 100us at 100kHz or 25us at 400kHz. 
+ * The default covers a 10ms write cycle at 1MHz. 
+ */
+#ifndef I2C_EEPROM_POLL_MAX
+#define I2C_EEPROM_POLL_MAX 1000
+#endif
+
+/** EEPROM class data. 
+ * Do NOT directly modify/read! 
+ * Must be stored in global sapce (define it outside of any function, define at compile time, no dynamic allocation of this variable) 
+ */
+typedef volatile struct I2C_Eeprom {
+	I2C_Transaction t; //Must be the first member, the done callback gets the object from it
+	I2C * volatile i2c;
+	volatile uint8_t addr; //Device address (0-127), block bits included by the driver for 1-byte address devices
+	volatile uint8_t addrSize; //Memory address size in bytes, 1 (24LC16 and smaller) or 2
+	volatile uint8_t pageSize; //Page size in bytes, power of 2
+	volatile enum i2c_state state; //Job: i2c_state_masterWrite or i2c_state_masterRead if in progress, i2c_state_free if done, i2c_state_error if failed
+	volatile uint16_t mem; //Memory address of current page
+	volatile uint8_t * volatile src; //Data of current page
+	volatile uint16_t left; //Bytes left to write, including current page
+	volatile uint16_t poll; //Address polls left
+	volatile uint8_t memAddr[2]; //Memory address bytes sent before the data, big-endian
+	I2C_Segment seg[2]; //Memory address, data
+} I2C_Eeprom;
+
+/* == Declaration =========================================================================== */
+
+void i2c_eeprom_init(I2C_Eeprom * const ee, I2C * const i2c, uint8_t addr, uint8_t addrSize, uint8_t pageSize);
+uint8_t i2c_eeprom_write(I2C_Eeprom * const ee, uint16_t mem, volatile uint8_t * data, uint16_t size);
+uint8_t i2c_eeprom_read(I2C_Eeprom * const ee, uint16_t mem, volatile uint8_t * data, uint16_t size);
+enum i2c_state i2c_eeprom_getState(const I2C_Eeprom * const ee);
+
+/* == Definition ============================================================================ */
+
+#ifndef I2C_EXTERN
+
+/* Fill the memory address bytes and the device address for memory address mem.
+ * 1-byte address devices larger than 256 bytes take the high bits of the memory address as block bits in the device address. */
+static inline void i2c_eeprom_address(I2C_Eeprom * const ee, const uint16_t mem) {
+	if (ee->addrSize == 1) {
+		ee->t.addr = ee->addr | ((mem >> 8) & 0x07);
+		ee->memAddr[0] = mem;
+	} else {
+		ee->t.addr = ee->addr;
+		ee->memAddr[0] = mem >> 8;
+		ee->memAddr[1] = mem;
+	}
+}
+
+/* Set up the transaction for the page at ee->mem: memory address segment then data segment, up to the page boundary. */
+static inline void i2c_eeprom_page(I2C_Eeprom * const ee) {
+	uint16_t room = ee->pageSize - (ee->mem & (ee->pageSize - 1));
+	i2c_eeprom_address(ee, ee->mem);
+	ee->seg[1].data = ee->src;
+	ee->seg[1].size = ee->left < room ? ee->left : room;
+}
+
+/* Done callback of the EEPROM transaction, in the TWI ISR.
+ * Address NAK means the device is in write cycle: submit the same transaction again (ACK polling). 
+ * Otherwise, go to the next page; after the last page, probe the address (no data) until the device ACKs, i.e. its write cycle is finished; then end the job. */
+static void i2c_eeprom_done(I2C_Transaction * const t) {
+	I2C_Eeprom * ee = (I2C_Eeprom *)t;
+	if (t->state == i2c_state_error) {
+		if ((t->status == i2c_status_masterWrite_addrNak) && ee->poll) {
+			ee->poll--;
+			if (i2c_queue(ee->i2c, t))
+				return;
+		}
+		ee->state = i2c_state_error;
+		return;
+	}
+
+	ee->poll = I2C_EEPROM_POLL_MAX;
+	if (ee->state == i2c_state_masterWrite && t->dir == i2c_dir_writeGather) { //Page written; otherwise, the probe of the last page is ACKed
+		uint16_t size = ee->seg[1].size;
+		ee->mem += size;
+		ee->src += size;
+		ee->left -= size;
+		if (ee->left) { //Next page, the first polls find the device busy with this page
+			i2c_eeprom_page(ee);
+		} else { //Last page, wait for its write cycle with address-only probes
+			t->dir = i2c_dir_write;
+			t->data = ee->memAddr;
+			t->size = 0;
+		}
+		if (!i2c_queue(ee->i2c, t))
+			ee->state = i2c_state_error;
+		return;
+	}
+	ee->state = i2c_state_free;
+}
+
+/** Init an EEPROM object. 
+ * Call i2c_init() first. 
+ * @param ee An EEPROM object, pass-by-reference, must be defined in global space at compile time 
+ * @param i2c I2C object initialised by i2c_init() 
+ * @param addr Device address (0-127), e.g. 0x50 with A2..A0 tied low 
+ * @param addrSize Memory address size in bytes: 1 for 24LC01 to 24LC16, 2 for 24LC32 and larger 
+ * @param pageSize Page size in bytes: 8 (24LC01/02), 16 (24LC04/08/16), 32 (24LC32/64), 64 (24LC128/256), 128 (24LC512), see datasheet 
+ */
+void i2c_eeprom_init(I2C_Eeprom * const ee, I2C * const i2c, uint8_t addr, uint8_t addrSize, uint8_t pageSize) {
+	ee->i2c = i2c;
+	ee->addr = addr;
+	ee->addrSize = addrSize;
+	ee->pageSize = pageSize;
+	ee->state = i2c_state_free;
+	ee->t.flag = 0;
+	ee->t.bitrate = 0;
+	ee->t.ring = NULL;
+	ee->t.done = i2c_eeprom_done;
+	ee->t.state = i2c_state_free;
+	ee->seg[0].data = ee->memAddr;
+	ee->seg[0].size = addrSize;
+}
+
+/** Write data of any length to the EEPROM, in background. 
+ * The data is split on page boundaries, each page is written in one transaction; 
+ * the write cycle of each page is waited by ACK polling in the ISR, then the next page is written immediately. 
+ * The job ends when the write cycle of the last page is finished, hence i2c_state_free means the data is in the memory (safe to sleep, power down or reset). 
+ * Use i2c_eeprom_getState() to check the progress. 
+ * @param ee EEPROM object initialised by i2c_eeprom_init() 
+ * @param mem Memory address to write to 
+ * @param data Data to write, must be stored in global space and not be modified until the job ends, DO NOT remove the volatile qualifier 
+ * @param size Size of the data in bytes (at least 1) 
+ * @return Non-zero if the job is started; 0 if the previous job is not finished or the queue is full 
+ */
+uint8_t i2c_eeprom_write(I2C_Eeprom * const ee, uint16_t mem, volatile uint8_t * data, uint16_t size) {
+	if (ee->state == i2c_state_masterWrite || ee->state == i2c_state_masterRead)
+		return 0;
+	ee->state = i2c_state_masterWrite;
+	ee->mem = mem;
+	ee->src = data;
+	ee->left = size;
+	ee->poll = I2C_EEPROM_POLL_MAX;
+	ee->t.dir = i2c_dir_writeGather;
+	ee->t.segment = (const I2C_Segment *)ee->seg; //Not modified while the transaction is active
+	ee->t.size = 2;
+	i2c_eeprom_page(ee);
+	if (!i2c_queue(ee->i2c, &ee->t)) {
+		ee->state = i2c_state_free;
+		return 0;
+	}
+	return 1;
+}
+
+/** Read data of any length from the EEPROM, in background. 
+ * The data is read in one sequential read (write memory address, repeated START, read), the device increments the address internally. 
+ * If the device is still in write cycle, it is waited by ACK polling in the ISR. 
+ * Use i2c_eeprom_getState() to check the progress. 
+ * @param ee EEPROM object initialised by i2c_eeprom_init() 
+ * @param mem Memory address to read from 
+ * @param data Space to save the data, must be stored in global space, DO NOT remove the volatile qualifier 
+ * @param size Size of the data in bytes (at least 1) 
+ * @return Non-zero if the job is started; 0 if the previous job is not finished or the queue is full 
+ */
+uint8_t i2c_eeprom_read(I2C_Eeprom * const ee, uint16_t mem, volatile uint8_t * data, uint16_t size) {
+	if (ee->state == i2c_state_masterWrite || ee->state == i2c_state_masterRead)
+		return 0;
+	ee->state = i2c_state_masterRead;
+	ee->poll = I2C_EEPROM_POLL_MAX;
+	i2c_eeprom_address(ee, mem);
+	ee->t.dir = i2c_dir_writeRead;
+	ee->t.data = ee->memAddr;
+	ee->t.size = ee->addrSize;
+	ee->t.readData = data;
+	ee->t.readSize = size;
+	if (!i2c_queue(ee->i2c, &ee->t)) {
+		ee->state = i2c_state_free;
+		return 0;
+	}
+	return 1;
+}
+
+/** Get the state of current EEPROM job. 
+ * @param ee EEPROM object initialised by i2c_eeprom_init() 
+ * @return i2c_state_masterWrite or i2c_state_masterRead if in progress (a write is in progress until the write cycle of its last page is finished), i2c_state_free if done, i2c_state_error if failed (device not responding or bus error) 
+ */
+enum i2c_state i2c_eeprom_getState(const I2C_Eeprom * const ee) {
+	return ee->state;
+}
+
+#endif /*#ifndef I2C_EXTERN*/
+
+#endif /*#ifndef I2C_EEPROM_H*/
\ No newline at end of file
@@ -0,0 +1,171 @@
+/** AVR I2C periodic polling lib 
+ * This library samples I2C sensors at fixed rates without the main program: 
+ * - A schedule table in flash (PROGMEM) lists the sensors, the register to read, the sample size and the period; and 
+ * - A hardware timer ISR calls i2c_poll_tick(), due sensors are submitted to the transaction queue of i2c.h; and 
+ * - The TWI ISR writes each sample into the back buffer of a double-buffered slot, then flips the buffer by incrementing the sequence counter. 
+ * The application reads the latest sample with i2c_poll_read() at any time, without disabling interrupt and without tearing. 
+ * Needs i2c.h, include i2c.h first. 
+ */
+
+#ifndef I2C_POLL_H
+#define I2C_POLL_H
+
+#include <avr/pgmspace.h>
+#include "i2c.h"
+
+/** Max sample size in bytes, size of each of the two buffers of a slot. 
+ */
+#ifndef I2C_POLL_SIZE
+#define I2C_POLL_SIZE 8
+#endif
+
+/** Schedule entry, the schedule table must be stored in flash (PROGMEM). 
+ * Each entry is sampled by a write-then-read transaction: write reg, repeated START, read size bytes. 
+ * e.g. const I2C_PollEntry schedule[] PROGMEM = { {0x68, 0x3B, 6, 1, 0}, {0x48, 0x00, 2, 100, 50} }; with a 1kHz tick: IMU at 1kHz, temperature at 10Hz. 
+ */
+typedef struct I2C_PollEntry {
+	uint8_t addr; //Slave address (0-127)
+	uint8_t reg; //Register to read from
+	uint8_t size; //Sample size in bytes (1 to I2C_POLL_SIZE)
+	uint16_t period; //Sampling period in ticks (at least 1)
+	uint16_t phase; //Ticks before the first sample, spread sensors of same period over different ticks to avoid bursts
+} I2C_PollEntry;
+
+/** Slot of a schedule entry, array in SRAM with one slot per entry. 
+ * Do NOT directly modify/read! Use i2c_poll_read(). 
+ * Must be stored in global sapce (define it outside of any function), the TWI ISR writes into it. 
+ */
+typedef volatile struct I2C_PollSlot {
+	I2C_Transaction t; //Must be the first member, the done callback gets the slot from it
+	volatile uint8_t seq; //Number of samples done (wraps), bit 0 gives the front buffer
+	volatile uint8_t overrun; //Number of samples skipped because the previous one was still in the queue or the queue was full (saturates at 255)
+	volatile uint8_t error; //Number of failed samples (saturates at 255), the front buffer keeps the last good sample
+	volatile uint16_t countdown; //Ticks to next sample
+	volatile uint8_t data[2][I2C_POLL_SIZE];
+} I2C_PollSlot;
+
+/** Polling scheduler data. 
+ * Do NOT directly modify/read! 
+ * Must be stored in global sapce (define it outside of any function, define at compile time, no dynamic allocation of this variable) 
+ */
+typedef volatile struct I2C_Poll {
+	I2C * volatile i2c;
+	const I2C_PollEntry * volatile table; //In flash
+	I2C_PollSlot * volatile slot;
+	volatile uint8_t count;
+	volatile uint8_t run;
+} I2C_Poll;
+
+/* == Declaration =========================================================================== */
+
+void i2c_poll_init(I2C_Poll * const poll, I2C * const i2c, const I2C_PollEntry * table, I2C_PollSlot * slot, uint8_t count);
+void i2c_poll_tick(I2C_Poll * const poll);
+void i2c_poll_run(I2C_Poll * const poll, uint8_t run);
+uint8_t i2c_poll_read(const I2C_Poll * const poll, uint8_t index, uint8_t * dst);
+
+/* == Definition ============================================================================ */
+
+#ifndef I2C_EXTERN
+
+/* Done callback of all polling transactions, in the TWI ISR.
+ * The sample is in the back buffer, flip it to the front. */
+static void i2c_poll_done(I2C_Transaction * const t) {
+	I2C_PollSlot * slot = (I2C_PollSlot *)t;
+	if (t->state == i2c_state_free)
+		slot->seq++;
+	else if (slot->error != 0xFF)
+		slot->error++;
+}
+
+/** Init a polling scheduler, the scheduler is stopped. 
+ * Call i2c_init() first, then i2c_poll_run() to start. 
+ * @param poll A polling scheduler object, pass-by-reference, must be defined in global space at compile time 
+ * @param i2c I2C object initialised by i2c_init() 
+ * @param table Schedule table in flash (PROGMEM) 
+ * @param slot Slot array in SRAM, one slot for each entry of the table 
+ * @param count Number of entries in the table 
+ */
+void i2c_poll_init(I2C_Poll * const poll, I2C * const i2c, const I2C_PollEntry * table, I2C_PollSlot * slot, uint8_t count) {
+	poll->run = 0;
+	poll->i2c = i2c;
+	poll->table = table;
+	poll->slot = slot;
+	poll->count = count;
+	for (uint8_t i = 0; i < count; i++) {
+		const I2C_PollEntry * e = table + i;
+		slot[i].t.addr = pgm_read_byte(&e->addr);
+		slot[i].t.dir = i2c_dir_writeRead;
+		slot[i].t.flag = i2c_flag_progmem; //Write phase reads reg from the table in flash
+		slot[i].t.data = (volatile uint8_t *)&e->reg;
+		slot[i].t.size = 1;
+		slot[i].t.readSize = pgm_read_byte(&e->size);
+		slot[i].t.bitrate = 0;
+		slot[i].t.ring = NULL;
+		slot[i].t.done = i2c_poll_done;
+		slot[i].t.state = i2c_state_free;
+		slot[i].seq = 0;
+		slot[i].overrun = 0;
+		slot[i].error = 0;
+		slot[i].countdown = pgm_read_word(&e->phase) + 1;
+	}
+}
+
+/** Start or stop the polling scheduler. 
+ * When stopped, samples already submitted still end normally. 
+ * @param poll Polling scheduler object initialised by i2c_poll_init() 
+ * @param run Non-zero to start, 0 to stop 
+ */
+void i2c_poll_run(I2C_Poll * const poll, uint8_t run) {
+	poll->run = run;
+}
+
+/** Put this function in a timer ISR, the tick period is the unit of the period and phase in the schedule table. 
+ * Each due entry is submitted to the transaction queue, hence the bus activity does not depend on the main program. 
+ * If the sample of the previous period is still in the queue, or the queue is full, this sample is skipped and counted as overrun. 
+ * Make I2C_QUEUE_SIZE larger than the number of entries that can be due in the same tick. 
+ * @param poll Polling scheduler object initialised by i2c_poll_init() 
+ */
+void i2c_poll_tick(I2C_Poll * const poll) {
+	if (!poll->run)
+		return;
+	I2C_PollSlot * slot = poll->slot;
+	const I2C_PollEntry * e = poll->table;
+	for (uint8_t i = poll->count; i; i--, slot++, e++) {
+		if (--slot->countdown)
+			continue;
+		slot->countdown = pgm_read_word(&e->period);
+		if (slot->t.state != i2c_state_free && slot->t.state != i2c_state_error) {
+			if (slot->overrun != 0xFF)
+				slot->overrun++;
+			continue;
+		}
+		slot->t.readData = slot->data[(slot->seq + 1) & 1]; //Back buffer
+		if (!i2c_queue(poll->i2c, &slot->t) && slot->overrun != 0xFF)
+			slot->overrun++;
+	}
+}
+
+/** Read the latest sample of an entry. 
+ * Lock-free: the sample is copied from the front buffer, then the sequence counter is checked again; 
+ * if the ISR flipped the buffer during the copy, the copy is done again. 
+ * @param poll Polling scheduler object initialised by i2c_poll_init() 
+ * @param index Index of the entry in the schedule table 
+ * @param dst Space to save the sample, size of the entry in bytes 
+ * @return Sequence counter of the sample (number of samples done, wraps after 255), compare with the value of last read to detect new samples 
+ */
+uint8_t i2c_poll_read(const I2C_Poll * const poll, uint8_t index, uint8_t * dst) {
+	I2C_PollSlot * slot = poll->slot + index;
+	uint8_t size = slot->t.readSize;
+	uint8_t seq;
+	do {
+		seq = slot->seq;
+		volatile uint8_t * src = slot->data[seq & 1];
+		for (uint8_t i = 0; i < size; i++)
+			dst[i] = src[i];
+	} while (seq != slot->seq);
+	return seq;
+}
+
+#endif /*#ifndef I2C_EXTERN*/
+
+#endif /*#ifndef I2C_POLL_H*/
\ No newline at end of file
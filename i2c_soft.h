@@ -0,0 +1,286 @@
+/** AVR software I2C lib 
+ * This library provides an I2C master on any two GPIO pins (bit-banged), with the same API as the TWI in i2c.h: 
+ * - The I2C object of a software bus points to an emulated TWI register file instead of the TWI registers; and 
+ * - i2c_soft_step() executes the command written in the emulated TWCR (START, one byte, or STOP) on the pins, sets the emulated TWSR, 
+ *   then runs the same ISR state machine as the TWI (i2c_isr()); and 
+ * - Hence i2c_master_*(), i2c_queue(), i2c_getState/Status/Progress(), retry, timeout, scan, SMBus and the drivers on top of them (i2c_poll.h, i2c_eeprom.h) 
+ *   work on the software bus unchanged, a driver moves to the second bus by passing the other I2C object. 
+ * Bit timing is computed at compile time from F_CPU and I2C_SOFT_RATE, and generated with cycle-exact delays; clock stretching by slaves is supported. 
+ * Master only: auto slave mode (i2c_slave_init()) and multi-master arbitration recovery beyond a lost bit are TWI only. 
+ * Needs i2c.h, include i2c.h first. 
+ */
+
+#ifndef I2C_SOFT_H
+#define I2C_SOFT_H
+
+#include "i2c.h"
+
+/** SCL frequency of all software buses in Hz, e.g. I2C_SM or I2C_FM. 
+ * Software buses do not use the bit rate of i2c_init() or I2C_Transaction.bitrate. 
+ */
+#ifndef I2C_SOFT_RATE
+#define I2C_SOFT_RATE I2C_SM
+#endif
+
+/** CPU cycles per half SCL period spent on the pin access and the loop, subtracted from the delay. 
+ * Calibrate with a scope if the exact rate matters; the bus never runs faster than I2C_SOFT_RATE if this is not larger than the real overhead. 
+ */
+#ifndef I2C_SOFT_OVERHEAD
+#define I2C_SOFT_OVERHEAD 16
+#endif
+
+/** Max number of polls of SCL while a slave stretches the clock (about 8 cycles each, 500us at default), then the command fails with bus error (i2c_status_error). 
+ */
+#ifndef I2C_SOFT_STRETCH
+#define I2C_SOFT_STRETCH ((uint16_t)(F_CPU / 1000000UL * 500 / 8))
+#endif
+
+#define I2C_SOFT_HALF (F_CPU / (2 * I2C_SOFT_RATE) - I2C_SOFT_OVERHEAD) //Delay cycles per half SCL period
+#if F_CPU / (2 * I2C_SOFT_RATE) <= I2C_SOFT_OVERHEAD
+#error "I2C_SOFT_RATE too high for F_CPU"
+#endif
+
+/** Software bus data, the emulated TWI register file. 
+ * Do NOT directly modify/read! 
+ * Must be stored in global sapce (define it outside of any function, define at compile time, no dynamic allocation of this variable) 
+ */
+typedef volatile struct I2C_Soft {
+	volatile uint8_t reg[6]; //TWBR, TWSR, TWAR, TWDR, TWCR, TWAMR; the I2C object points to it
+} I2C_Soft;
+
+/* == Declaration =========================================================================== */
+
+void i2c_soft_init(I2C * const i2c, I2C_Soft * const soft, volatile uint8_t * const pin, const uint8_t sda, const uint8_t scl);
+uint8_t i2c_soft_step(I2C * const i2c);
+
+/* == Definition ============================================================================ */
+
+#ifndef I2C_EXTERN
+
+#define SFR_TWSR	1
+#define SFR_TWDR	3
+#define SFR_TWCR	4
+
+#define I2C_SOFT_ACK	0 //Results of a byte
+#define I2C_SOFT_NAK	1
+#define I2C_SOFT_LOST	2
+#define I2C_SOFT_STUCK	3
+
+/* Open drain: DDR set drives the line low, DDR clear releases it to the pull-up. PINx, DDRx, PORTx are consecutive. */
+static inline void i2c_soft_low(I2C * const i2c, const uint8_t line) {
+	i2c->busPin[1] |= line;
+}
+static inline void i2c_soft_release(I2C * const i2c, const uint8_t line) {
+	i2c->busPin[1] &= ~line;
+}
+static inline void i2c_soft_delay(void) {
+	__builtin_avr_delay_cycles(I2C_SOFT_HALF);
+}
+
+/* Release SCL and wait while a slave stretches the clock, return 0 if SCL is still low after I2C_SOFT_STRETCH polls. */
+static inline uint8_t i2c_soft_sclHigh(I2C * const i2c) {
+	volatile uint8_t * const pin = i2c->busPin;
+	const uint8_t scl = i2c->busScl;
+	pin[1] &= ~scl;
+	for (uint16_t n = I2C_SOFT_STRETCH; !(pin[0] & scl); n--) {
+		if (!n)
+			return 0;
+	}
+	return 1;
+}
+
+/* Send a byte MSB first and read the ACK bit; SCL is low before and after.
+ * A 1 bit read back as 0 means another master drives SDA: arbitration lost, both lines are released. */
+static uint8_t i2c_soft_write(I2C * const i2c, uint8_t data) {
+	const uint8_t sda = i2c->busSda;
+	for (uint8_t i = 8; i; i--) {
+		if (data & 0x80)
+			i2c_soft_release(i2c, sda);
+		else
+			i2c_soft_low(i2c, sda);
+		i2c_soft_delay();
+		if (!i2c_soft_sclHigh(i2c))
+			return I2C_SOFT_STUCK;
+		i2c_soft_delay();
+		if ((data & 0x80) && !(i2c->busPin[0] & sda)) {
+			i2c_soft_release(i2c, i2c->busScl);
+			return I2C_SOFT_LOST;
+		}
+		i2c_soft_low(i2c, i2c->busScl);
+		data <<= 1;
+	}
+	i2c_soft_release(i2c, sda); //ACK bit, driven by the slave
+	i2c_soft_delay();
+	if (!i2c_soft_sclHigh(i2c))
+		return I2C_SOFT_STUCK;
+	i2c_soft_delay();
+	uint8_t nak = i2c->busPin[0] & sda;
+	i2c_soft_low(i2c, i2c->busScl);
+	return nak ? I2C_SOFT_NAK : I2C_SOFT_ACK;
+}
+
+/* Read a byte MSB first into *data and send ACK (ack non-zero) or NAK; SCL is low before and after. */
+static uint8_t i2c_soft_read(I2C * const i2c, uint8_t * const data, const uint8_t ack) {
+	const uint8_t sda = i2c->busSda;
+	uint8_t byte = 0;
+	i2c_soft_release(i2c, sda);
+	for (uint8_t i = 8; i; i--) {
+		i2c_soft_delay();
+		if (!i2c_soft_sclHigh(i2c))
+			return I2C_SOFT_STUCK;
+		i2c_soft_delay();
+		byte = (byte << 1) | ((i2c->busPin[0] & sda) ? 1 : 0);
+		i2c_soft_low(i2c, i2c->busScl);
+	}
+	if (ack)
+		i2c_soft_low(i2c, sda);
+	i2c_soft_delay();
+	if (!i2c_soft_sclHigh(i2c))
+		return I2C_SOFT_STUCK;
+	i2c_soft_delay();
+	i2c_soft_low(i2c, i2c->busScl);
+	i2c_soft_release(i2c, sda);
+	*data = byte;
+	return I2C_SOFT_ACK;
+}
+
+/* START, or repeated START if this master holds the bus (SCL driven low).
+ * Return 0 if the bus is busy (not held and a line is low), the command is kept for the next step. */
+static uint8_t i2c_soft_start(I2C * const i2c) {
+	volatile uint8_t * const pin = i2c->busPin;
+	const uint8_t sda = i2c->busSda, scl = i2c->busScl;
+	if (pin[1] & scl) { //Repeated START: SDA high, SCL high, then SDA low
+		i2c_soft_release(i2c, sda);
+		i2c_soft_delay();
+		if (!i2c_soft_sclHigh(i2c))
+			return 0;
+		i2c_soft_delay();
+	} else if ((pin[0] & (sda | scl)) != (sda | scl)) {
+		return 0;
+	}
+	i2c_soft_low(i2c, sda);
+	i2c_soft_delay();
+	i2c_soft_low(i2c, scl);
+	return 1;
+}
+
+/* STOP: SDA low to high while SCL high, both lines released after. */
+static void i2c_soft_stop(I2C * const i2c) {
+	const uint8_t sda = i2c->busSda;
+	i2c_soft_low(i2c, sda);
+	i2c_soft_delay();
+	i2c_soft_sclHigh(i2c);
+	i2c_soft_delay();
+	i2c_soft_release(i2c, sda);
+	i2c_soft_delay();
+}
+
+/** Init a software bus. 
+ * The I2C object then works with all functions of i2c.h except auto slave mode; use it in place of i2c_init(). 
+ * Both pins need external pull-up resistors, the internal pull-up is turned off (open drain by DDR). 
+ * @param i2c An I2C object, pass-by-reference, must be defined in global space at compile time 
+ * @param soft A software bus object, must be defined in global space at compile time 
+ * @param pin Address of the PINx register of the port, DDRx and PORTx must follow it, e.g. &PIND 
+ * @param sda Bit number of SDA in the port 
+ * @param scl Bit number of SCL in the port 
+ */
+void i2c_soft_init(I2C * const i2c, I2C_Soft * const soft, volatile uint8_t * const pin, const uint8_t sda, const uint8_t scl) {
+	i2c_init(i2c, soft->reg, 0);
+	i2c_busPins(i2c, pin, sda, scl);
+	pin[1] &= ~((1 << sda) | (1 << scl));
+	pin[2] &= ~((1 << sda) | (1 << scl));
+	soft->reg[SFR_TWSR] = i2c_status_free;
+	soft->reg[SFR_TWCR] = (1 << TWEN);
+}
+
+/** Drive a software bus. 
+ * Put this function in a timer ISR, or call it in the main loop. Each call executes at most one command: 
+ * START, one byte (9 SCL periods, e.g. 90us at 100kHz), or STOP; then runs the ISR state machine of i2c.h like a TWI interrupt, which writes the next command. 
+ * Hence the timer rate sets the throughput in bytes per second; to run a transaction to its end at full speed, call it in a loop: while (i2c_soft_step(&i2c1)); 
+ * A transaction submitted while the STOP of the previous one is pending waits in the queue and starts after that STOP. 
+ * Put i2c_soft_step() and i2c_queue() of the same bus in the same interrupt priority, or submit with interrupt disabled. 
+ * @param i2c I2C object initialised by i2c_soft_init() 
+ * @return Non-zero if a command is executed, 0 if idle (no command, or waiting for a busy bus) 
+ */
+uint8_t i2c_soft_step(I2C * const i2c) {
+	volatile uint8_t * const sfr = i2c->sfrAddr;
+	const uint8_t twcr = sfr[SFR_TWCR];
+	if (!(twcr & (1 << TWINT)))
+		return 0;
+	uint8_t status = sfr[SFR_TWSR] & 0xF8;
+	if (twcr & (1 << TWSTO)) {
+		i2c_soft_stop(i2c);
+		status = i2c_status_free;
+		if (!(twcr & (1 << TWSTA))) { //STOP only, no interrupt
+			sfr[SFR_TWSR] = status;
+			sfr[SFR_TWCR] = twcr & ~((1 << TWINT) | (1 << TWSTO));
+			if (!i2c->transaction && i2c->queueOut != i2c->queueIn) //Submitted while this STOP was pending, i2c_queue() left it in the queue
+				i2c_finish(i2c, sfr, i2c_state_free, (1 << TWEN)); //Start it, START in the next step
+			return 1;
+		}
+	}
+	if (twcr & (1 << TWSTA)) {
+		uint8_t held = i2c->busPin[1] & i2c->busScl;
+		if (!i2c_soft_start(i2c)) {
+			if (twcr & (1 << TWSTO)) //STOP is done, keep START for the next step
+				sfr[SFR_TWCR] = twcr & ~(1 << TWSTO);
+			sfr[SFR_TWSR] = i2c_status_free;
+			return 0;
+		}
+		status = held ? i2c_status_master_repeatedStart : i2c_status_master_start;
+	} else {
+		uint8_t result;
+		switch (status) {
+			case i2c_status_master_start:
+			case i2c_status_master_repeatedStart: //Address
+				{
+					uint8_t sla = sfr[SFR_TWDR];
+					result = i2c_soft_write(i2c, sla);
+					if (sla & 1)
+						status = result == I2C_SOFT_ACK ? i2c_status_masterRead_addrAck : i2c_status_masterRead_addrNak;
+					else
+						status = result == I2C_SOFT_ACK ? i2c_status_masterWrite_addrAck : i2c_status_masterWrite_addrNak;
+				}
+				break;
+			case i2c_status_masterWrite_addrAck:
+			case i2c_status_masterWrite_dataAck:
+			case i2c_status_masterWrite_dataNak:
+				result = i2c_soft_write(i2c, sfr[SFR_TWDR]);
+				status = result == I2C_SOFT_ACK ? i2c_status_masterWrite_dataAck : i2c_status_masterWrite_dataNak;
+				break;
+			case i2c_status_masterRead_addrAck:
+			case i2c_status_masterRead_dataAck:
+				{
+					uint8_t data;
+					result = i2c_soft_read(i2c, &data, twcr & (1 << TWEA));
+					sfr[SFR_TWDR] = data;
+					status = (twcr & (1 << TWEA)) ? i2c_status_masterRead_dataAck : i2c_status_masterRead_dataNak;
+				}
+				break;
+			default: //No command in this state
+				result = I2C_SOFT_STUCK;
+		}
+		if (result == I2C_SOFT_LOST)
+			status = i2c_status_master_lost;
+		else if (result == I2C_SOFT_STUCK)
+			status = i2c_status_error;
+	}
+	sfr[SFR_TWSR] = status;
+	sfr[SFR_TWCR] = twcr & ~((1 << TWINT) | (1 << TWSTA) | (1 << TWSTO));
+	if (twcr & (1 << TWIE))
+		i2c_isr(i2c, sfr);
+	return 1;
+}
+
+#undef I2C_SOFT_STUCK
+#undef I2C_SOFT_LOST
+#undef I2C_SOFT_NAK
+#undef I2C_SOFT_ACK
+
+#undef SFR_TWCR
+#undef SFR_TWDR
+#undef SFR_TWSR
+
+#endif /*#ifndef I2C_EXTERN*/
+
+#endif /*#ifndef I2C_SOFT_H*/
@@ -1,4 +1,5 @@
 #include <avr/io.h>
+#include <avr/interrupt.h>
 #include <avr/pgmspace.h>
 #include "uart.h"
 
@@ -7,27 +8,21 @@ UART serial;
 void main (void) {
 	volatile char msg[] = "This is a test message.\r\n"; //In main(), main() will never return hence will not be orerriden
 
-	serial = uart_init (&UCSR0A, 16000000, 9600, (struct uart_init_mode){
-		.rxEnable = uart_mode_manual,
-		.txEnable = uart_mode_auto,
-		.speed = uart_mode_speedNormal,
-		.stopBits = uart_mode_stop2
-	});
+	uart_init(&serial, &UCSR0A, 16000000, 9600, uart_mode_rxManual | uart_mode_txAuto | uart_mode_stop2);
 
 	sei();
 	for(;;) {
 		/*
 		for (int i = 0; i < sizeof(msg); i++) {
-			while (!uart_sendReady(&serial));
-			uart_sendChar(&serial, msg[i]);
+			while (!uart_sendFree(&serial));
+			uart_sendManual(&serial, msg[i]);
 		}
 		*/
-		while (!uart_sendReady(&serial));
-		uart_sendString(&serial, msg, sizeof(msg));
-		while (uart_sendStringProgress(&serial));
+		uart_sendAuto(&serial, (volatile uint8_t *)msg, sizeof(msg));
+		uart_waitTxDone(&serial, NULL); //Sleep until the ISR sent the whole string
 	}
 }
 
 ISR (USART0_TX_vect) {
-	uart_sendString_ISR(&serial);
+	uart_sendAuto_ISR(&serial);
 }
\ No newline at end of file
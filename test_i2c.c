@@ -0,0 +1,347 @@
+#define F_CPU 16000000UL
+#define I2C_RETRY_BACKOFF 2 //Ticks before the first retry, doubled each retry: covers the 5ms write cycle of the EEPROM
+#define I2C_SMBUS //PEC and block read for the battery, 25-35ms clock low timeout by i2c_tick() at 1kHz
+#define I2C_SOFT_RATE I2C_SM
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
+#include <stdio.h>
+#include "uart.h"
+#include "crc.h"
+#include "i2c.h"
+#include "i2c_soft.h"
+#include "i2c_poll.h"
+#include "i2c_eeprom.h"
+
+/* Self-check of the I2C library, each check prints PASS, FAIL or SKIP on UART0 at 115200, then the number of failures.
+ * Wiring: one bus with pull-ups on the TWI pins (SDA, SCL), a 24LC256 EEPROM at 0x50 (A2-A0 to GND, nothing at 0x51),
+ * and the software bus pins PD6 (SDA) and PD7 (SCL) wired to the same two lines.
+ * The TWI is a master and an auto slave at 0x20; the software bus is a second master on the same wires, so it talks to the TWI slave
+ * and meets the TWI master on the bus. Optional: an SMBus smart battery at 0x0B, skipped if absent.
+ * The software bus is stepped from the main program, so the TWI interrupt preempts it (clock stretching by the TWI slave). */
+
+UART serial;
+I2C i2c0, i2c1;
+I2C_Soft soft;
+FILE out;
+volatile uint8_t serialQueue[128];
+
+volatile uint16_t wait; //ms, counted down by the timer ISR
+volatile uint8_t tick;
+uint8_t failed;
+
+/* == TWI master ============================================================================ */
+
+volatile uint8_t eeAddr[2] = {0x01, 0x00};
+volatile uint8_t eeData[4] = {'T', 'E', 'S', 'T'};
+volatile uint8_t eeRead[4];
+const I2C_Segment eeSeg[2] = { {eeAddr, 2}, {eeData, 4} }; //Memory address then data, one transaction without copy
+I2C_Transaction eeWrite, eeCheck, absent;
+
+const uint8_t script[] PROGMEM = {
+	0x50, 4, 0x02, 0x00, 'O', 'K', 10, //Memory address 0x0200, then wait the write cycle
+	I2C_SCRIPT_END
+};
+
+I2C_Eeprom ee;
+volatile uint8_t record[8] = {1, 2, 3, 4, 5, 6, 7, 8}, readBack[8];
+
+volatile uint8_t ringSpace[4]; //Smaller than the read, the bus is held until the main program pops
+I2C_Ring ring;
+volatile uint8_t ringAddr[2] = {0x00, 60};
+I2C_Transaction stream;
+
+volatile uint8_t cmdVoltage[1] = {0x09};
+volatile uint8_t voltage[2];
+I2C_Transaction battery;
+
+/* == TWI slave ============================================================================= */
+
+volatile uint8_t regs[6] = {0x00, 0x77, 0x12, 0x34, 0x00, 0x00}; //Control, status, temperature (2), reserved, sync
+const uint8_t regMask[6] PROGMEM = {0xFF, 0x00, 0x00, 0x00, 0x00, 0xFF}; //Host can write control and sync only
+volatile uint8_t hostReg = 0xFF, hostCount;
+
+void hostWrite(uint8_t reg, uint8_t count) { //In the TWI ISR
+	hostReg = reg;
+	hostCount = count;
+}
+
+/* == Software master ======================================================================= */
+
+volatile uint8_t wControl[2] = {0x00, 0x5A}, wStatus[2] = {0x01, 0xFF}, wSync[2] = {0x05, 0xA5}, wNext[2] = {0x00, 0xC3};
+volatile uint8_t rReg[1] = {0x02}, rControl[1] = {0x00}, rData[2], rNext[1];
+I2C_Transaction s1, s2, s3;
+
+I2C_Eeprom ee1;
+volatile uint8_t boot[1], bootCheck[1];
+
+const I2C_PollEntry schedule[] PROGMEM = {
+	{0x20, 0x02, 2, 10, 0} //Temperature registers of the TWI slave, every 10 ticks
+};
+I2C_PollSlot slot[1];
+I2C_Poll poll;
+
+/* == Helpers =============================================================================== */
+
+void check(const char * name, uint8_t pass) {
+	printf("%s %s\r\n", pass ? "PASS" : "FAIL", name);
+	if (!pass)
+		failed++;
+}
+
+void skip(const char * name) {
+	printf("SKIP %s\r\n", name);
+}
+
+void report(const char * name, const I2C_Transaction * t) {
+	printf("     %s: state %d status %02X count %u retry %u\r\n", name, t->state, t->status, t->count, t->retry);
+}
+
+uint8_t busy(enum i2c_state state) {
+	return state != i2c_state_free && state != i2c_state_error;
+}
+
+void waitSet(uint16_t ms) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		wait = ms;
+	}
+}
+
+uint8_t waitLeft(void) {
+	uint16_t ms;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		ms = wait;
+	}
+	return ms != 0;
+}
+
+uint8_t twiWait(void) { //Wait until the TWI is idle, at most 200ms
+	waitSet(200);
+	return i2c_waitIdle(&i2c0, &wait);
+}
+
+uint8_t eeWait(const I2C_Eeprom * e, uint8_t stepSoft) { //Wait until an EEPROM job ends, at most 200ms; non-zero if done without error
+	waitSet(200);
+	while (busy(i2c_eeprom_getState(e)) && waitLeft()) {
+		if (stepSoft)
+			i2c_soft_step(&i2c1);
+	}
+	return i2c_eeprom_getState(e) == i2c_state_free;
+}
+
+uint8_t softWait(const I2C_Transaction * t) { //Step the software bus until t ends, at most 200ms; the STOP may still be pending
+	waitSet(200);
+	while (busy(t->state) && waitLeft())
+		i2c_soft_step(&i2c1);
+	return t->state == i2c_state_free;
+}
+
+void softFlush(void) { //Run the software bus until idle, e.g. the pending STOP
+	while (i2c_soft_step(&i2c1));
+}
+
+uint8_t softRun(I2C_Transaction * t) {
+	if (!i2c_queue(&i2c1, t))
+		return 0;
+	uint8_t ok = softWait(t);
+	softFlush();
+	return ok;
+}
+
+void setup(I2C_Transaction * t, i2c_addr addr, enum i2c_dir dir, volatile uint8_t * data, uint16_t size, volatile uint8_t * readData, uint16_t readSize) {
+	t->addr = addr;
+	t->dir = dir;
+	t->flag = 0;
+	t->data = data;
+	t->size = size;
+	t->readData = readData;
+	t->readSize = readSize;
+	t->bitrate = 0;
+	t->ring = NULL;
+	t->done = NULL;
+}
+
+/* == Checks ================================================================================ */
+
+void main (void) {
+	uart_init(&serial, &UCSR0A, F_CPU, 115200, uart_mode_txQueue);
+	uart_sendSpace(&serial, serialQueue, sizeof(serialQueue));
+	uart_stream(&serial, &out, 0);
+	stdout = &out;
+
+	TCCR0A = (1 << WGM01); //1kHz tick: CTC, clk/64
+	OCR0A = F_CPU / 64 / 1000 - 1;
+	TCCR0B = (1 << CS01) | (1 << CS00);
+	TIMSK0 = (1 << OCIE0A);
+
+	i2c_init(&i2c0, &TWBR, I2C_BITRATE(F_CPU, I2C_SM));
+	i2c_slave_init(&i2c0, 0x20, regs, regMask, sizeof(regs), hostWrite);
+	i2c_slave_generalCall(&i2c0, 1);
+	i2c_soft_init(&i2c1, &soft, &PIND, 6, 7);
+	i2c_eeprom_init(&ee, &i2c0, 0x50, 2, 64);
+	i2c_eeprom_init(&ee1, &i2c1, 0x50, 2, 64);
+	i2c_ringInit(&ring, ringSpace, sizeof(ringSpace));
+	sei();
+
+	/* Bus scan and presence cache: the TWI does not see its own slave address, the software bus does */
+	i2c_scan(&i2c0);
+	while (i2c_isScanning(&i2c0));
+	check("TWI scan finds the EEPROM", !i2c_getScanFail(&i2c0) && i2c_getPresent(&i2c0, 0x50) && !i2c_getPresent(&i2c0, 0x51));
+	i2c_scan(&i2c1);
+	while (i2c_isScanning(&i2c1))
+		i2c_soft_step(&i2c1);
+	softFlush();
+	check("Soft scan finds the EEPROM and the TWI slave", !i2c_getScanFail(&i2c1) && i2c_getPresent(&i2c1, 0x50) && i2c_getPresent(&i2c1, 0x20));
+
+	setup(&absent, 0x51, i2c_dir_write, eeData, sizeof(eeData), NULL, 0);
+	i2c_queue(&i2c0, &absent);
+	check("Absent device fails fast", absent.state == i2c_state_error && absent.status == i2c_status_absent && absent.count == 0);
+
+	/* Transaction queue: a gather write and its read-back run back-to-back, the read is retried while the EEPROM is in write cycle */
+	setup(&eeWrite, 0x50, i2c_dir_writeGather, NULL, 2, NULL, 0);
+	eeWrite.segment = eeSeg;
+	setup(&eeCheck, 0x50, i2c_dir_writeRead, eeAddr, sizeof(eeAddr), eeRead, sizeof(eeRead));
+	eeCheck.flag = i2c_flag_retry;
+	eeCheck.bitrate = I2C_BITRATE(F_CPU, I2C_FM); //24LC256 runs at 400kHz, the bus default is 100kHz
+	i2c_queue(&i2c0, &eeWrite);
+	i2c_queue(&i2c0, &eeCheck);
+	twiWait();
+	check("Queue: gather write", eeWrite.state == i2c_state_free && eeWrite.count == 6);
+	report("write", &eeWrite);
+	uint8_t same = eeCheck.state == i2c_state_free && eeCheck.count == 6;
+	for (uint8_t i = 0; i < sizeof(eeData); i++)
+		same = same && eeRead[i] == eeData[i];
+	check("Queue: read back with retry", same);
+	report("read", &eeCheck);
+
+	/* Flash script, read back by the EEPROM driver */
+	uint8_t ok = i2c_script(&i2c0, script);
+	ok = ok && i2c_eeprom_read(&ee, 0x0200, readBack, 2) && eeWait(&ee, 0);
+	check("Flash script", ok && readBack[0] == 'O' && readBack[1] == 'K');
+
+	/* EEPROM driver: 8 bytes at 60 cross the 64-byte page boundary */
+	ok = i2c_eeprom_write(&ee, 60, record, sizeof(record)) && eeWait(&ee, 0);
+	ok = ok && i2c_eeprom_read(&ee, 60, readBack, sizeof(readBack)) && eeWait(&ee, 0);
+	for (uint8_t i = 0; i < sizeof(record); i++)
+		ok = ok && readBack[i] == record[i];
+	check("EEPROM driver across a page", ok);
+
+	/* Streaming read of the same 8 bytes through a 4-byte ring */
+	setup(&stream, 0x50, i2c_dir_writeRead, ringAddr, sizeof(ringAddr), NULL, sizeof(record));
+	stream.ring = &ring;
+	i2c_queue(&i2c0, &stream);
+	uint8_t got = 0, data;
+	waitSet(200);
+	for (;;) {
+		uint8_t running = busy(stream.state); //Check before the pop, so the last bytes are not missed
+		while (i2c_ringPop(&i2c0, &ring, &data)) {
+			if (got < sizeof(record) && data == record[got])
+				got++;
+		}
+		if (!running || !waitLeft())
+			break;
+	}
+	check("Ring read", stream.state == i2c_state_free && stream.count == 2 + sizeof(record) && got == sizeof(record));
+
+	/* Software master on the TWI slave: register write, write mask, general call, register read, 10-bit address */
+	setup(&s1, 0x20, i2c_dir_write, wControl, sizeof(wControl), NULL, 0);
+	ok = softRun(&s1);
+	check("Slave write", ok && regs[0] == 0x5A && hostReg == 0 && hostCount == 1);
+	setup(&s1, 0x20, i2c_dir_write, wStatus, sizeof(wStatus), NULL, 0);
+	softRun(&s1);
+	check("Slave read-only register", regs[1] == 0x77);
+	setup(&s1, 0x00, i2c_dir_write, wSync, sizeof(wSync), NULL, 0);
+	ok = softRun(&s1);
+	check("Slave general call", ok && regs[5] == 0xA5);
+	setup(&s1, 0x20, i2c_dir_writeRead, rReg, sizeof(rReg), rData, sizeof(rData));
+	ok = softRun(&s1);
+	check("Slave read", ok && rData[0] == 0x12 && rData[1] == 0x34 && s1.count == 3);
+	setup(&s1, I2C_ADDR10(0x2A5), i2c_dir_write, wControl, sizeof(wControl), NULL, 0);
+	softRun(&s1);
+	check("10-bit address not answered", s1.state == i2c_state_error && s1.status == i2c_status_masterWrite_addrNak && s1.count == 0);
+
+	/* Two transactions submitted back to back while the STOP of the previous one is still pending on the software bus */
+	setup(&s1, 0x20, i2c_dir_write, wControl, sizeof(wControl), NULL, 0);
+	setup(&s2, 0x20, i2c_dir_write, wNext, sizeof(wNext), NULL, 0);
+	setup(&s3, 0x20, i2c_dir_writeRead, rControl, sizeof(rControl), rNext, sizeof(rNext));
+	i2c_queue(&i2c1, &s1);
+	softWait(&s1);
+	i2c_queue(&i2c1, &s2);
+	i2c_queue(&i2c1, &s3);
+	ok = softWait(&s3);
+	softFlush();
+	check("Back to back after STOP", s2.state == i2c_state_free && ok && rNext[0] == 0xC3);
+
+	/* EEPROM driver on the software bus: read then write right after it, a boot counter */
+	ok = i2c_eeprom_read(&ee1, 0x0300, boot, 1) && eeWait(&ee1, 1);
+	boot[0]++;
+	ok = ok && i2c_eeprom_write(&ee1, 0x0300, boot, 1) && eeWait(&ee1, 1);
+	ok = ok && i2c_eeprom_read(&ee1, 0x0300, bootCheck, 1) && eeWait(&ee1, 1);
+	softFlush();
+	check("Soft EEPROM read then write", ok && bootCheck[0] == boot[0]);
+	printf("     boot %u\r\n", boot[0]);
+
+	/* Multi-master: the software master addresses the TWI slave, a TWI transaction submitted meanwhile waits, then starts after the STOP */
+	setup(&s1, 0x20, i2c_dir_write, wControl, sizeof(wControl), NULL, 0);
+	i2c_queue(&i2c1, &s1);
+	i2c_soft_step(&i2c1); //START
+	i2c_soft_step(&i2c1); //Address, the TWI is a slave now
+	eeRead[0] = eeRead[1] = eeRead[2] = eeRead[3] = 0;
+	i2c_queue(&i2c0, &eeCheck);
+	ok = softWait(&s1);
+	softFlush();
+	twiWait();
+	same = ok && eeCheck.state == i2c_state_free && eeCheck.count == 6;
+	for (uint8_t i = 0; i < sizeof(eeData); i++)
+		same = same && eeRead[i] == eeData[i];
+	check("TWI master queued while addressed as slave", same && regs[0] == 0x5A);
+	report("read", &eeCheck);
+
+	/* Polling scheduler on the software bus, ticked from the main program like i2c_soft_step() */
+	i2c_poll_init(&poll, &i2c1, schedule, slot, 1);
+	i2c_poll_run(&poll, 1);
+	uint8_t sample[2] = {0}, last = tick;
+	waitSet(100);
+	while (waitLeft()) {
+		if (tick != last) {
+			last++;
+			i2c_poll_tick(&poll);
+		}
+		i2c_soft_step(&i2c1);
+	}
+	i2c_poll_run(&poll, 0);
+	softFlush();
+	uint8_t seq = i2c_poll_read(&poll, 0, sample);
+	check("Polling scheduler", seq >= 5 && !slot[0].error && sample[0] == 0x12 && sample[1] == 0x34);
+
+	/* SMBus read word with PEC (little-endian) */
+	if (i2c_getPresent(&i2c0, 0x0B) && !i2c_getScanFail(&i2c0)) {
+		setup(&battery, 0x0B, i2c_dir_writeRead, cmdVoltage, sizeof(cmdVoltage), voltage, sizeof(voltage));
+		battery.flag = i2c_flag_pec | i2c_flag_retry;
+		i2c_queue(&i2c0, &battery);
+		twiWait();
+		check("SMBus read word with PEC", battery.state == i2c_state_free && battery.count == 3);
+		printf("     voltage %u mV, retry %u\r\n", voltage[0] | voltage[1] << 8, battery.retry);
+	} else {
+		skip("SMBus read word with PEC (no battery at 0x0B)");
+	}
+
+	printf("Done, %u failed\r\n", failed);
+	uart_waitTxDone(&serial, NULL);
+	for(;;);
+}
+
+I2C_ISR(TWI_vect, i2c0, &TWBR)
+
+ISR (TIMER0_COMPA_vect) {
+	i2c_tick(&i2c0);
+	tick++;
+	if (wait)
+		wait--;
+}
+
+ISR (USART0_UDRE_vect) {
+	uart_sendQueue_ISR(&serial);
+}
@@ -1,7 +1,8 @@
 /** AVR UART lib 
- * This library provides two high level interface for AVR USART hardware: 
+ * This library provides three high level interface for AVR USART hardware: 
  * - Manual mode: one character at a time with pooling (busy-wait); and 
  * - Auto mode: give the address, this library will use interrupt to send/receive a string of characters, while the application can use the CPU to perform other tasks. 
+ * - Queued mode: push characters into a ring buffer, this library will use interrupt to send them; the auto receiver of one UART can be bridged into the queue of another UART. 
  * This library has not implement a few options provided by the hardware, hence the limitation: 
  * - Always UART, no USART, no master SPI; and
  * - Always use 8-bit data; and
@@ -13,7 +14,11 @@
 #define UART_H
 
 #include <stddef.h>
+#include <stdio.h>
 #include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <util/atomic.h>
 
 typedef uint8_t uart_mode;
 #define uart_mode_txManual	0x01 //Polling / busy-wait method on transmitter
@@ -22,6 +27,17 @@ typedef uint8_t uart_mode;
 #define uart_mode_rxAuto	0x08 //Auto UART, handled by this lib and ISR on receiver
 #define uart_mode_stop2		0x10 //Use 2 stop bits instead of 1
 #define uart_mode_speedDouble	0x20 //Double speed mode, 8 clock instead of 16 clock / bit
+#define uart_mode_txQueue	0x40 //Queued UART, bytes pushed into a ring buffer are sent by this lib and ISR on transmitter
+
+/** Running CRC. 
+ * Define UART_CRC as the name of a CRC update function before including this lib, e.g. "#define UART_CRC crc_modbus16" after including crc.h. 
+ * Each byte sent by uart_sendAuto() is folded into the transmitter CRC in the ISR, each byte read by uart_receiveFetch() is folded into the receiver CRC. 
+ * The CRC type follows the return type of the function. 
+ * If UART_CRC is defined, the transmitter ISR uses the C code instead of the inline assembly. 
+ */
+#ifdef UART_CRC
+typedef __typeof__(UART_CRC(0, 0)) uart_crc;
+#endif
 
 /** UART class data. 
  * Do NOT directly modify/read! 
@@ -31,7 +47,12 @@ typedef volatile struct UART {
 	volatile uint8_t * volatile srfAddr;
 	volatile uint8_t mode;
 	volatile const uint8_t * volatile tx_ptr, * volatile tx_end;
-	volatile uint8_t * volatile rx_ptr, * volatile rx_end, * volatile rx_addr;
+	volatile uint8_t * volatile rx_ptr, * volatile rx_end, * volatile rx_addr, * volatile rx_out;
+	volatile uint8_t * volatile txq_in, * volatile txq_out, * volatile txq_end, * volatile txq_addr;
+	volatile struct UART * volatile bridge;
+#ifdef UART_CRC
+	volatile uart_crc tx_crc, rx_crc;
+#endif
 } UART;
 
 /* == Init ================================================================================== */
@@ -39,16 +60,30 @@ typedef volatile struct UART {
 /** Init or reset a software UART interfacec, config the hardware, set the BAUD rate. 
  * Some MCU comes with multiple independent UART, they can have different setting. 
  * The transmitter and receiver can be set in manual or auto mode repectly and independently. 
- * If *manual and *auto mode are flaged at the same time, will use auto mode. 
+ * If *manual and *auto mode are flaged at the same time, will use auto mode. If txQueue is flaged, it takes precedence over other transmitter modes. 
  * If use auto transmitter mode, place uart_sendAuto_ISR in the USART_TX_vect or USARTn_TX_vect ISR. 
+ * If use queued transmitter mode, place uart_sendQueue_ISR in the USART_UDRE_vect or USARTn_UDRE_vect ISR. 
+ * If use auto receiver mode, place uart_receiveAuto_ISR in the USART_RX_vect or USARTn_RX_vect ISR. 
  * @param uart A UART object, pass-by-reference, must be defined in global space at compile time. 
  * @param sft_base The address of UCSRnA register of the desired UART
  * @param f_cpu The CPU speed
- * @param baud The UART BAUD rate
+ * @param baud The UART BAUD rate, from f_cpu / 65536 to f_cpu / 16 (f_cpu / 32768 to f_cpu / 8 in double speed mode); out of this range, the BAUD rate register is not written
  * @param config ORed uart_mode_* used to set the behaviour
  * @return Actual BAUD rate the hardware will provide, may slightly differ from the baud argument
  */
-void uart_init(UART * const uart, volatile void * const sfr_base, const uint32_t f_cpu, const uint16_t baud, const uart_mode mode);
+void uart_init(UART * const uart, volatile void * const sfr_base, const uint32_t f_cpu, const uint32_t baud, const uart_mode mode);
+
+/** Change the BAUD rate without re-init. 
+ * Wait until the transmitter has sent all characters (see uart_waitTxDone()), then reprogram the BAUD rate register atomically. 
+ * Mode, the auto receiver buffer space, the transmitter queue and the bridge are kept, characters already received are not lost. 
+ * The speed mode (normal or double) set by uart_init() is kept. 
+ * The application should not push new characters while this function is running, and the peer should not send while switching. 
+ * @param uart UART object returned by uart_init()
+ * @param f_cpu The CPU speed
+ * @param baud The new UART BAUD rate, same range as uart_init()
+ * @return Actual BAUD rate the hardware will provide, may slightly differ from the baud argument; 0 if baud is out of range, nothing is changed
+ */
+uint32_t uart_setBaud(UART * const uart, const uint32_t f_cpu, const uint32_t baud);
 
 /* == Sender ================================================================================ */
 
@@ -89,6 +124,50 @@ uint16_t uart_sendAutoProgress(const UART * const uart);
  */
 static inline void uart_sendAuto_ISR(UART * const uart);
 
+/** Assign a ring buffer space for the queued transmitter. 
+ * This also empties the queue, do not call it while the queue is sending. 
+ * The queue can hold size-1 bytes. 
+ * @param uart UART object returned by uart_init()
+ * @param address Address of the buffer space, DO NOT remove the volatile qualifier
+ * @param size Size of the buffer space in bytes
+ */
+void uart_sendSpace(UART * const uart, volatile uint8_t * const address, const uint16_t size);
+
+/** Push one character into the queue of the queued transmitter. 
+ * The ISR will send it after all bytes pushed before it. 
+ * This function is atomic, it can be called from the main program and from other ISR (e.g. a bridged receiver). 
+ * @param uart UART object returned by uart_init()
+ * @param data Data to send
+ * @return Non-zero if data is pushed into the queue; 0 if queue is full, data is dropped
+ */
+static inline uint8_t uart_sendPush(UART * const uart, const uint8_t data);
+
+/** Get number of character in the queue waiting to send, this result is valid only if use queued transmitter mode. 
+ * @param uart UART object returned by uart_init()
+ * @return Number of bytes left to send
+ */
+uint16_t uart_sendQueueProgress(const UART * const uart);
+
+/** Put this function in the USART_UDRE_vect or USARTn_UDRE_vect ISR if you use queued transmitter mode. 
+ * @param uart UART object returned by uart_init()
+ */
+static inline void uart_sendQueue_ISR(UART * const uart);
+
+#ifdef UART_CRC
+/** Get the running CRC of the transmitter. 
+ * Read it after uart_sendAutoProgress() returns 0, the ISR updates it while sending. 
+ * @param uart UART object returned by uart_init()
+ * @return Running CRC of all bytes sent by uart_sendAuto() or from the queue since last uart_sendCrcReset()
+ */
+uart_crc uart_sendCrc(const UART * const uart);
+
+/** Reset the running CRC of the transmitter. 
+ * @param uart UART object returned by uart_init()
+ * @param init Initial value of the CRC, e.g. crc_modbus16_init
+ */
+void uart_sendCrcReset(UART * const uart, const uart_crc init);
+#endif
+
 /* == Receiver ============================================================================== */
 
 /** Check for new data in receiver. 
@@ -103,11 +182,21 @@ uint8_t uart_receiveReady (UART * uart);
 uint8_t uart_receiveFetch (UART * uart);
 
 /** Assign a buffer space for receiver. 
+ * The receiver pointer and the read pointer are moved to the start of the space, hence the buffer space is empty. 
+ * Call this before enabling the receiver in auto mode, the ISR saves incoming characters at the receiver pointer. 
  * @param uart UART object returned by uart_init()
  */
 void uart_receiveSpace (UART * uart, volatile uint8_t * address, uint16_t size);
 
+/** Put this function in the USART_RX_vect or USARTn_RX_vect ISR if you use auto receiver mode. 
+ * Each incoming character is saved at the receiver pointer, the pointer wraps back to the start of the buffer space at the end of the space. 
+ * If the receiver is bridged (see uart_bridge()), the character is pushed into the queue of the other UART's transmitter instead. 
+ * @param uart UART object returned by uart_init()
+ */
+static inline void uart_receiveAuto_ISR(UART * const uart);
+
 /** Reset the receiver pointer. 
+ * This also moves the read pointer used by uart_receivePop() to the same place, hence the buffer space becomes empty. 
  * @param ptr New pointer, must be greater or equal to the buffer space address and less than address+size
  */
 void uart_receiveReset (UART * uart, volatile uint8_t * ptr);
@@ -117,9 +206,101 @@ void uart_receiveReset (UART * uart, volatile uint8_t * ptr);
  */
 volatile uint8_t * uart_receivGetptr (UART * uart);
 
+/** Read one character received by the auto receiver, in the order they are received. 
+ * The buffer space is used as a ring: this function reads from its own pointer until it reaches the receiver pointer. 
+ * The ISR does not wait for this function, characters not read before the receiver pointer wraps around are overwritten. 
+ * @param uart UART object returned by uart_init()
+ * @param data Where to save the character
+ * @return Non-zero if a character is read; 0 if nothing new in the buffer space
+ */
+uint8_t uart_receivePop(UART * const uart, uint8_t * const data);
+
+#ifdef UART_CRC
+/** Get the running CRC of the receiver. 
+ * @param uart UART object returned by uart_init()
+ * @return Running CRC of all bytes fetched or received by the ISR since last uart_receiveCrcReset()
+ */
+uart_crc uart_receiveCrc(const UART * const uart);
+
+/** Reset the running CRC of the receiver. 
+ * @param uart UART object returned by uart_init()
+ * @param init Initial value of the CRC, e.g. crc_modbus16_init
+ */
+void uart_receiveCrcReset(UART * const uart, const uart_crc init);
+#endif
+
+/* == Bridge ================================================================================ */
+
+/** Bridge the receiver of one UART to the transmitter of another UART. 
+ * Every character received by uart_receiveAuto_ISR() of the source is pushed into the queue of the destination in the same ISR, 
+ * hence the latency is bounded by one ISR and does not depend on the main program. 
+ * The source must be in auto receiver mode, the destination must be in queued transmitter mode with a space assigned by uart_sendSpace(). 
+ * Characters are dropped if the destination queue is full. 
+ * To bridge both ways, call this function twice with swapped arguments. 
+ * @param from UART object whose receiver is bridged
+ * @param to UART object whose transmitter sends the bridged characters, NULL to remove the bridge
+ */
+void uart_bridge(UART * const from, UART * const to);
+
+/* == Stream ================================================================================ */
+
+/** Bind a UART to an avr-libc stdio stream, e.g. stdout and stdin, so puts(), printf(), fputs_P() and getchar() use this UART. 
+ * Use a stream set up by this function (or FDEV_SETUP_STREAM with uart_streamPut/uart_streamGet functions and fdev_set_udata()). 
+ * Transmitter: in queued mode, characters are pushed into the queue and sent by ISR; in manual mode, characters are sent one by one with busy-wait. Auto mode is not supported, put returns _FDEV_EOF (the auto sender ISR owns the transmitter). 
+ * Receiver: in auto mode, characters are read by uart_receivePop(); in manual mode, characters are fetched from the receiver. 
+ * In blocking mode, a full queue or an empty receiver puts the CPU in IDLE sleep (queued / auto mode) or busy-waits (manual mode) until it can continue. 
+ * In non-blocking mode, put returns _FDEV_EOF if the queue is full and get returns _FDEV_EOF if no character received; 
+ * note that stdio sets the EOF flag of the stream, call clearerr() before next read. 
+ * @param uart UART object returned by uart_init()
+ * @param stream The stream to set up, e.g. a FILE defined in global space, then assign it to stdout / stdin
+ * @param nonblock Non-zero for non-blocking mode; 0 for blocking mode
+ */
+void uart_stream(UART * const uart, FILE * const stream, const uint8_t nonblock);
+
+/** Stream put function, blocking mode. 
+ * @param c Character to send
+ * @param stream Stream set up by uart_stream()
+ * @return 0; _FDEV_EOF if the transmitter is not in queued or manual mode
+ */
+int uart_streamPut(char c, FILE * stream);
+
+/** Stream put function, non-blocking mode. 
+ * @param c Character to send
+ * @param stream Stream set up by uart_stream()
+ * @return 0 if character is sent or pushed into the queue; _FDEV_EOF if the transmitter is busy, the queue is full, or the transmitter is not in queued or manual mode
+ */
+int uart_streamPutNonblock(char c, FILE * stream);
+
+/** Stream get function, blocking mode. 
+ * @param stream Stream set up by uart_stream()
+ * @return Received character
+ */
+int uart_streamGet(FILE * stream);
+
+/** Stream get function, non-blocking mode. 
+ * @param stream Stream set up by uart_stream()
+ * @return Received character; _FDEV_EOF if no character received
+ */
+int uart_streamGetNonblock(FILE * stream);
+
+/* == Wait ================================================================================== */
+
+/** Wait until the transmitter has sent all characters, instead of busy-polling uart_sendAutoProgress() or uart_sendQueueProgress(). 
+ * In auto and queued transmitter mode, the CPU is put in IDLE sleep between interrupts; the condition is checked with interrupt disabled 
+ * and the CPU goes to sleep in the instruction right after SEI, hence a wake-up interrupt cannot be missed. 
+ * In queued and manual transmitter mode, the last character is waited by polling the TXC flag (no interrupt for it), this takes at most one character time. 
+ * This function sets the sleep mode to IDLE and enables global interrupt. 
+ * @param uart UART object returned by uart_init()
+ * @param timeout Address of a counter decremented by the application in a timer ISR, give up when it reaches 0; NULL to wait without timeout
+ * @return Non-zero if all characters sent; 0 if timed out
+ */
+uint8_t uart_waitTxDone(const UART * const uart, volatile const uint16_t * const timeout);
+
 /* == Definition ============================================================================ */
 
+#ifndef UART_CRC
 #define ASM_SENDAUTO_ISR
+#endif
 
 #define SFR_DATA 6
 #define SFR_BAUD 4 //12-bit right-align
@@ -127,40 +308,78 @@ volatile uint8_t * uart_receivGetptr (UART * uart);
 #define SFR_CFGB 1
 #define SFR_CFGA 0
 
-void uart_init(UART * const uart, volatile void * const sfr_base, const uint32_t f_cpu, const uint16_t baud, const uart_mode mode) {
-	uart->srfAddr = sfr_base;
-	uart->mode = 0;
-	
-	if (mode | uart_mode_speedDouble) {
-		uint16_t clk = f_cpu / 8 / baud - 1;
-		uart->srfAddr[SFR_BAUD+0] = clk >> 0;
-		uart->srfAddr[SFR_BAUD+1] = clk >> 8;
-		uart->srfAddr[SFR_CFGA] |= (1 << U2X0);
+/* Compute the BAUD divider (UBRR + 1) from f_cpu and baud, round to the nearest divider. 
+ * Returns 0 if the divider does not fit the 12-bit UBRR (baud too high or too low for f_cpu). */
+static inline uint16_t uart_baudDivider(const UART * const uart, const uint32_t f_cpu, const uint32_t baud) {
+	uint8_t div = (uart->mode & uart_mode_speedDouble) ? 8 : 16;
+	if (!baud || baud > f_cpu) //Also keeps baud * div in 32 bits
+		return 0;
+	uint32_t n = (f_cpu + baud * div / 2) / (baud * div);
+	return (n && n <= 4096) ? n : 0;
+}
 
-	} else {
-		uint16_t clk = f_cpu / 16 / baud - 1;
-		uart->srfAddr[SFR_BAUD+0] = clk >> 0;
-		uart->srfAddr[SFR_BAUD+1] = clk >> 8;
-	}
+/* Program UBRR and U2X with a divider from uart_baudDivider(). 
+ * Returns the actual BAUD rate. */
+static inline uint32_t uart_writeBaud(UART * const uart, const uint32_t f_cpu, const uint16_t n) {
+	uint8_t div = (uart->mode & uart_mode_speedDouble) ? 8 : 16;
+	uint16_t clk = n - 1;
+	uart->srfAddr[SFR_BAUD+1] = clk >> 8; //High byte first, writing the low byte updates the BAUD prescaler
+	uart->srfAddr[SFR_BAUD+0] = clk >> 0;
+	uart->srfAddr[SFR_CFGA] = (div == 8) ? (1 << U2X0) : 0; //FE, DOR and UPE must be written 0
+	return f_cpu / ((uint32_t)div * (clk + 1));
+}
+
+/* Wait until the last character left the shift register. 
+ * TXC is cleared each time a character is loaded in manual and queued mode. If nothing was sent since init, TXC never sets, hence the wait is bounded to one frame (11 bits) time. */
+static inline void uart_drain(const UART * const uart) {
+	while (!(uart->srfAddr[SFR_CFGA] & (1 << UDRE0)));
+	uint16_t clk = (uart->srfAddr[SFR_BAUD+1] << 8) | uart->srfAddr[SFR_BAUD+0];
+	uint32_t loop = (uint32_t)(clk + 1) * ((uart->srfAddr[SFR_CFGA] & (1 << U2X0)) ? 8 : 16) * 11 / 4; //Each loop takes more than 4 cycles
+	while (!(uart->srfAddr[SFR_CFGA] & (1 << TXC0)) && loop--);
+}
 
-	if (mode | uart_mode_txAuto) {
-		uart->srfAddr[SFR_CFGB] |= (1 << TXEN0) | (1 << TXCIE0);
+void uart_init(UART * const uart, volatile void * const sfr_base, const uint32_t f_cpu, const uint32_t baud, const uart_mode mode) {
+	uint8_t cfgb = 0;
+	uart->srfAddr = sfr_base;
+	uart->mode = mode & uart_mode_speedDouble;
+	uart->bridge = NULL;
+
+	uart->srfAddr[SFR_CFGB] = 0; //Disable transmitter, receiver and interrupts while re-configuring
+	uint16_t n = uart_baudDivider(uart, f_cpu, baud);
+	if (n)
+		uart_writeBaud(uart, f_cpu, n);
+	uart->srfAddr[SFR_CFGC] = (1 << UCSZ01) | (1 << UCSZ00) | ((mode & uart_mode_stop2) ? (1 << USBS0) : 0); //Async, 8-bit data, no parity
+
+	if (mode & uart_mode_txQueue) {
+		cfgb |= (1 << TXEN0); //UDRIE is set when data pushed into the queue
+		uart->mode |= uart_mode_txQueue;
+	} else if (mode & uart_mode_txAuto) {
+		cfgb |= (1 << TXEN0) | (1 << TXCIE0);
 		uart->mode |= uart_mode_txAuto;
-	} else if (mode | uart_mode_txManual) {
-		uart->srfAddr[SFR_CFGB] |= (1 << TXEN0);
+	} else if (mode & uart_mode_txManual) {
+		cfgb |= (1 << TXEN0);
 		uart->mode |= uart_mode_txManual;
 	}
-	if (mode | uart_mode_rxAuto) {
-		uart->srfAddr[SFR_CFGB] |= (1 << RXEN0) | (1 << RXCIE0);
+	if (mode & uart_mode_rxAuto) {
+		cfgb |= (1 << RXEN0) | (1 << RXCIE0);
 		uart->mode |= uart_mode_rxAuto;
-	} else if (mode | uart_mode_rxManual) {
-		uart->srfAddr[SFR_CFGB] |= (1 << RXEN0);
+	} else if (mode & uart_mode_rxManual) {
+		cfgb |= (1 << RXEN0);
 		uart->mode |= uart_mode_rxManual;
 	}
-	
-	if (mode | uart_mode_stop2) {
-		uart->srfAddr[SFR_CFGC] |= (1 << USBS0);
+	uart->srfAddr[SFR_CFGB] = cfgb;
+}
+
+uint32_t uart_setBaud(UART * const uart, const uint32_t f_cpu, const uint32_t baud) {
+	uint32_t actual;
+	uint16_t n = uart_baudDivider(uart, f_cpu, baud);
+	if (!n)
+		return 0;
+	uart_waitTxDone(uart, NULL);
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		actual = uart_writeBaud(uart, f_cpu, n);
 	}
+	return actual;
 }
 
 static inline uint8_t uart_sendFree(const UART * const uart) {
@@ -185,10 +404,14 @@ static inline uint8_t uart_sendFree(const UART * const uart) {
 
 void uart_sendManual(const UART * const uart, const uint8_t data) {
 	uart->srfAddr[SFR_DATA] = data;
+	uart->srfAddr[SFR_CFGA] = (uart->srfAddr[SFR_CFGA] & ((1 << U2X0) | (1 << MPCM0))) | (1 << TXC0); //Clear TXC after loading, so uart_waitTxDone() can tell when this byte is shifted out (TXC does not set while a byte is pending)
 }
 
 void uart_sendAuto(UART * const uart, volatile const uint8_t * const data, const uint16_t size) {
 	uart->srfAddr[SFR_DATA] = *data;
+#ifdef UART_CRC
+	uart->tx_crc = UART_CRC(uart->tx_crc, *data);
+#endif
 	uart->tx_ptr = data;
 	uart->tx_end = data + size;
 }
@@ -200,8 +423,13 @@ uint16_t uart_sendAutoProgress (const UART * const uart) {
 static inline void uart_sendAuto_ISR (UART * const uart) {
 #ifndef ASM_SENDAUTO_ISR
 	uart->tx_ptr++;
-	if (uart->tx_ptr != uart->tx_end)
-		uart->srfAddr[SFR_DATA] = *uart->tx_ptr;
+	if (uart->tx_ptr != uart->tx_end) {
+		uint8_t data = *uart->tx_ptr;
+		uart->srfAddr[SFR_DATA] = data;
+	#ifdef UART_CRC
+		uart->tx_crc = UART_CRC(uart->tx_crc, data);
+	#endif
+	}
 #else /* #ifndef ASM_SENDAUTO_ISR */
 	asm volatile (
 		//	uart->tx_ptr++;
@@ -234,27 +462,247 @@ static inline void uart_sendAuto_ISR (UART * const uart) {
 #endif /* #ifndef ASM_SENDAUTO_ISR */
 }
 
+void uart_sendSpace(UART * const uart, volatile uint8_t * const address, const uint16_t size) {
+	uart->txq_addr = address;
+	uart->txq_end = address + size;
+	uart->txq_in = address;
+	uart->txq_out = address;
+}
+
+static inline uint8_t uart_sendPush(UART * const uart, const uint8_t data) {
+	uint8_t pushed = 0;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { //May be called from main and from the ISR of a bridged receiver at the same time
+		volatile uint8_t * in = uart->txq_in;
+		volatile uint8_t * next = in + 1;
+		if (next == uart->txq_end)
+			next = uart->txq_addr;
+		if (next != uart->txq_out) { //One slot always empty to tell full from empty
+			*in = data;
+			uart->txq_in = next;
+			uart->srfAddr[SFR_CFGB] |= (1 << UDRIE0);
+			pushed = 1;
+		}
+	}
+	return pushed;
+}
+
+uint16_t uart_sendQueueProgress(const UART * const uart) {
+	volatile uint8_t * in, * out;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		in = uart->txq_in;
+		out = uart->txq_out;
+	}
+	return in >= out ? in - out : (uart->txq_end - uart->txq_addr) - (out - in);
+}
+
+static inline void uart_sendQueue_ISR(UART * const uart) {
+	volatile uint8_t * out = uart->txq_out;
+	if (out == uart->txq_in) { //Queue empty, stop the data register empty interrupt
+		uart->srfAddr[SFR_CFGB] &= ~(1 << UDRIE0);
+		return;
+	}
+	uint8_t data = *(out++);
+	uart->srfAddr[SFR_DATA] = data;
+	uart->srfAddr[SFR_CFGA] = (uart->srfAddr[SFR_CFGA] & ((1 << U2X0) | (1 << MPCM0))) | (1 << TXC0); //Clear TXC, so uart_waitTxDone() can tell when this byte is shifted out
+#ifdef UART_CRC
+	uart->tx_crc = UART_CRC(uart->tx_crc, data);
+#endif
+	if (out == uart->txq_end)
+		out = uart->txq_addr;
+	uart->txq_out = out;
+	if (out == uart->txq_in) //Last byte loaded, no need to come back
+		uart->srfAddr[SFR_CFGB] &= ~(1 << UDRIE0);
+}
+
 uint8_t uart_receiveReady (UART * uart) {
 	return uart->srfAddr[SFR_CFGA] & (1 << RXC0);
 }
 
 uint8_t uart_receiveFetch (UART * uart) {
+#ifdef UART_CRC
+	uint8_t data = uart->srfAddr[SFR_DATA];
+	uart->rx_crc = UART_CRC(uart->rx_crc, data);
+	return data;
+#else
 	return uart->srfAddr[SFR_DATA];
+#endif
 }
 
 void uart_receiveSpace (UART * uart, volatile uint8_t * address, uint16_t size) {
-	uart->rx_addr = address;
-	uart->rx_end = address + size;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		uart->rx_addr = address;
+		uart->rx_end = address + size;
+		uart->rx_ptr = address;
+		uart->rx_out = address;
+	}
+}
+
+static inline void uart_receiveAuto_ISR(UART * const uart) {
+	uint8_t data = uart->srfAddr[SFR_DATA];
+#ifdef UART_CRC
+	uart->rx_crc = UART_CRC(uart->rx_crc, data);
+#endif
+	UART * const bridge = uart->bridge;
+	if (bridge) {
+		uart_sendPush(bridge, data);
+	} else {
+		volatile uint8_t * ptr = uart->rx_ptr;
+		*(ptr++) = data;
+		if (ptr == uart->rx_end)
+			ptr = uart->rx_addr;
+		uart->rx_ptr = ptr;
+	}
 }
 
 void uart_receiveReset (UART * uart, volatile uint8_t * ptr) {
-	uart->rx_ptr = ptr;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		uart->rx_ptr = ptr;
+		uart->rx_out = ptr;
+	}
 }
 
 volatile uint8_t * uart_receivGetptr (UART * uart) {
 	return uart->rx_ptr;
 }
 
+uint8_t uart_receivePop(UART * const uart, uint8_t * const data) {
+	volatile uint8_t * in, * out = uart->rx_out;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		in = uart->rx_ptr;
+	}
+	if (out == in)
+		return 0;
+	*data = *(out++);
+	if (out == uart->rx_end)
+		out = uart->rx_addr;
+	uart->rx_out = out;
+	return 1;
+}
+
+#ifdef UART_CRC
+uart_crc uart_sendCrc(const UART * const uart) {
+	return uart->tx_crc;
+}
+
+void uart_sendCrcReset(UART * const uart, const uart_crc init) {
+	uart->tx_crc = init;
+}
+
+uart_crc uart_receiveCrc(const UART * const uart) {
+	return uart->rx_crc;
+}
+
+void uart_receiveCrcReset(UART * const uart, const uart_crc init) {
+	uart->rx_crc = init;
+}
+#endif
+
+void uart_bridge(UART * const from, UART * const to) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { //16-bit pointer, read by the receiver ISR
+		from->bridge = to;
+	}
+}
+
+void uart_stream(UART * const uart, FILE * const stream, const uint8_t nonblock) {
+	if (nonblock) {
+		fdev_setup_stream(stream, uart_streamPutNonblock, uart_streamGetNonblock, _FDEV_SETUP_RW);
+	} else {
+		fdev_setup_stream(stream, uart_streamPut, uart_streamGet, _FDEV_SETUP_RW);
+	}
+	fdev_set_udata(stream, (void *)uart);
+}
+
+int uart_streamPut(char c, FILE * stream) {
+	UART * const uart = fdev_get_udata(stream);
+	if (uart->mode & uart_mode_txQueue) {
+		set_sleep_mode(SLEEP_MODE_IDLE);
+		for (;;) {
+			cli();
+			if (uart_sendPush(uart, c))
+				break;
+			sleep_enable();
+			sei(); //Queue is full hence UDRIE is set, the ISR will wake the CPU
+			sleep_cpu();
+			sleep_disable();
+		}
+		sei();
+	} else if (uart->mode & uart_mode_txManual) {
+		while (!uart_sendFree(uart));
+		uart_sendManual(uart, c);
+	} else { //Auto mode: the TXC ISR would keep sending from its own buffer
+		return _FDEV_EOF;
+	}
+	return 0;
+}
+
+int uart_streamPutNonblock(char c, FILE * stream) {
+	UART * const uart = fdev_get_udata(stream);
+	if (uart->mode & uart_mode_txQueue)
+		return uart_sendPush(uart, c) ? 0 : _FDEV_EOF;
+	if (!(uart->mode & uart_mode_txManual) || !uart_sendFree(uart))
+		return _FDEV_EOF;
+	uart_sendManual(uart, c);
+	return 0;
+}
+
+int uart_streamGet(FILE * stream) {
+	UART * const uart = fdev_get_udata(stream);
+	uint8_t data;
+	if (uart->mode & uart_mode_rxAuto) {
+		set_sleep_mode(SLEEP_MODE_IDLE);
+		for (;;) {
+			cli();
+			if (uart_receivePop(uart, &data))
+				break;
+			sleep_enable();
+			sei(); //The receiver ISR will wake the CPU
+			sleep_cpu();
+			sleep_disable();
+		}
+		sei();
+		return data;
+	}
+	while (!uart_receiveReady(uart));
+	return uart_receiveFetch(uart);
+}
+
+int uart_streamGetNonblock(FILE * stream) {
+	UART * const uart = fdev_get_udata(stream);
+	uint8_t data;
+	if (uart->mode & uart_mode_rxAuto)
+		return uart_receivePop(uart, &data) ? data : _FDEV_EOF;
+	if (!uart_receiveReady(uart))
+		return _FDEV_EOF;
+	return uart_receiveFetch(uart);
+}
+
+uint8_t uart_waitTxDone(const UART * const uart, volatile const uint16_t * const timeout) {
+	uint8_t done;
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	for (;;) {
+		cli();
+		if (uart->mode & uart_mode_txQueue)
+			done = uart->txq_out == uart->txq_in;
+		else if (uart->mode & uart_mode_txAuto)
+			done = uart->tx_ptr == uart->tx_end;
+		else
+			done = 1;
+		if (done || (timeout && !*timeout))
+			break;
+		sleep_enable();
+		sei(); //The instruction after SEI is always executed before any pending interrupt
+		sleep_cpu();
+		sleep_disable();
+	}
+	sei();
+	if (!done)
+		return 0;
+
+	if (!(uart->mode & uart_mode_txAuto)) //Auto mode ISR is on TXC already
+		uart_drain(uart);
+	return 1;
+}
+
 #undef SFR_DATA
 #undef SFR_BAUD
 #undef SFR_CFGC